@@ -0,0 +1,751 @@
+//Benchmarks the callbacks of mkfs.c without mounting: calls oper directly against a scratch image and prints
+//one line of key=value pairs per measured phase (ops/sec, MB/sec and latency percentiles from the op statistics)
+#define MKFS_NO_MAIN
+#include "mkfs.c"
+
+#include <getopt.h>
+#include <limits.h>
+
+//----------------------------------------------------------------------------------------------------------------->
+//Size of the scratch image in MiB, unless -s is given
+#define BENCH_IMAGE_MB 128
+
+//Size of the files of the sequential and random scenarios
+#define BENCH_FILE_KB 16384
+
+//Random reads and writes per size
+#define BENCH_RANDOM_OPS 4096
+
+//Directories of the metadata storm, each filled with FILES_PER_RECORD files
+#define BENCH_META_DIRS 200
+
+//Logical size of the sparse file, far larger than the image
+#define BENCH_SPARSE_MB 4096
+
+//Files appended to in turn and how large each of them grows
+#define BENCH_APPEND_FILES 8
+#define BENCH_APPEND_KB 2048
+
+//Files in the one directory of the large directory scenario
+#define BENCH_BIG_DIR_FILES 50000
+
+//Entries one readdir call returns before its buffer is full, about what fits in the page the kernel asks for
+#define BENCH_READDIR_PAGE 128
+
+//Largest file of the small file scenario, sizes are spread evenly up to it
+#define BENCH_SMALL_BYTES 1024
+
+//Create and delete rounds which age the image before it is measured
+#define BENCH_AGING_ROUNDS 4000
+
+//Threads of the concurrent scenario, the rounds each of them runs and how many of its files are alive at a time
+#define BENCH_THREADS 8
+#define BENCH_THREAD_ROUNDS 2000
+#define BENCH_THREAD_FILES 8
+
+//Largest file of the concurrent scenario
+#define BENCH_THREAD_BYTES 6000
+//----------------------------------------------------------------------------------------------------------------->
+
+//One scenario: a name for the command line and the function which runs it on a freshly mounted image
+struct bench_scenario {
+    const char* name;
+    void (*run)();
+};
+
+static const char* scratch_dir = "bench_root";
+static char start_dir[PATH_MAX]; //Where bench was started, it holds the sample image
+static int image_mb = BENCH_IMAGE_MB;
+static int image_block_size = DEFAULT_BLOCK_SIZE;
+static int image_members = 1;
+static uint64_t rng = 88172645463325252ULL;
+
+//the phase being measured
+static const char* phase_scenario;
+static struct timespec phase_start;
+
+static uint64_t next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double seconds_since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void fail(const char* what, const char* path, int res) {
+    fprintf(stderr, "bench: %s %s failed: %s\n", what, path, strerror(-res));
+    exit(1);
+}
+
+//formats and mounts a new image of image_mb MiB with blocks of image_block_size bytes, striped over image_members
+//files in the scratch directory
+static void mount_scratch() {
+    int res = format_volume((off_t) image_mb * 1024 * 1024, image_block_size, 0, NULL, image_members, STRIPE_KB * 1024);
+    if (res != 0) {
+        fprintf(stderr, "bench: cannot format an image in %s: %s\n", scratch_dir, strerror(-res));
+        exit(1);
+    }
+    oper.init(NULL);
+}
+
+//clears the statistics and starts the clock for one phase
+static void phase_begin(const char* scenario) {
+    phase_scenario = scenario;
+    memset(&stats, 0, sizeof(stats));
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+//prints the statistics of op for the phase which just ended
+static void phase_end(const char* phase, int op) {
+    double secs = seconds_since(&phase_start);
+    struct mkfs_op_stats* st = &stats.ops[op];
+    uint64_t calls = 0;
+    int b;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        calls += st->hist[b];
+    }
+    if (calls == 0) return;
+
+    printf("scenario=%s phase=%s block_size=%d direct=%d uring=%d members=%d op=%s ops=%llu secs=%.4f ops_per_sec=%.0f mb_per_sec=%.1f p50_us=%.1f p90_us=%.1f "
+            "p99_us=%.1f p999_us=%.1f max_us=%.1f errors=%llu allocations=%llu relocations=%llu\n",
+            phase_scenario, phase, block_size, image.direct, ring.fd != -1, image.nmembers, op_names[op], (unsigned long long) calls, secs, calls / secs,
+            st->bytes / secs / (1024 * 1024),
+            percentile(st->hist, calls, 0.5, st->max_ns) / 1000.0,
+            percentile(st->hist, calls, 0.9, st->max_ns) / 1000.0,
+            percentile(st->hist, calls, 0.99, st->max_ns) / 1000.0,
+            percentile(st->hist, calls, 0.999, st->max_ns) / 1000.0,
+            st->max_ns / 1000.0, (unsigned long long) st->errors,
+            (unsigned long long) stats.allocations, (unsigned long long) stats.relocations);
+    fflush(stdout);
+}
+
+static void create_file(const char* path, struct fuse_file_info* fi) {
+    int res = oper.mknod(path, S_IFREG | 0666, 0);
+    if (res != 0 && res != -EEXIST) fail("mknod", path, res);
+    memset(fi, 0, sizeof(*fi));
+    fi->flags = O_RDWR;
+    res = oper.open(path, fi);
+    if (res != 0) fail("open", path, res);
+}
+
+static void close_file_handle(const char* path, struct fuse_file_info* fi) {
+    oper.flush(path, fi);
+    oper.release(path, fi);
+}
+
+static void write_at(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    int res = oper.write(path, buf, size, offset, fi);
+    if (res != (int) size) fail("write", path, res < 0 ? res : -ENOSPC);
+}
+
+static void read_at(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    int res = oper.read(path, buf, size, offset, fi);
+    if (res < 0) fail("read", path, res);
+}
+
+//mkdir, mknod, getattr and unlink of many small directories
+static void bench_meta() {
+    char path[32];
+    struct stat st;
+    int d, f, round, res;
+    int files = (int) (FILES_PER_RECORD);
+
+    phase_begin("meta");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        sprintf(path, "/m%d", d);
+        if ((res = oper.mkdir(path, 0755)) != 0) fail("mkdir", path, res);
+    }
+    phase_end("mkdir", OP_MKDIR);
+
+    phase_begin("meta");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        for (f = 0; f < files; f++) {
+            sprintf(path, "/m%d/f%d.txt", d, f);
+            if ((res = oper.mknod(path, S_IFREG | 0666, 0)) != 0) fail("mknod", path, res);
+        }
+    }
+    phase_end("mknod", OP_MKNOD);
+
+    phase_begin("meta");
+    for (round = 0; round < 4; round++) {
+        for (d = 0; d < BENCH_META_DIRS; d++) {
+            for (f = 0; f < files; f++) {
+                sprintf(path, "/m%d/f%d.txt", d, f);
+                if ((res = oper.getattr(path, &st)) != 0) fail("getattr", path, res);
+            }
+        }
+    }
+    phase_end("getattr", OP_GETATTR);
+
+    phase_begin("meta");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        sprintf(path, "/m%d/none.txt", d);
+        oper.getattr(path, &st);
+    }
+    phase_end("getattr_missing", OP_GETATTR);
+
+    phase_begin("meta");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        for (f = 0; f < files; f++) {
+            sprintf(path, "/m%d/f%d.txt", d, f);
+            if ((res = oper.unlink(path)) != 0) fail("unlink", path, res);
+        }
+    }
+    phase_end("unlink", OP_UNLINK);
+}
+
+//readdir filler which takes BENCH_READDIR_PAGE entries and remembers where the listing goes on
+static int listed;
+static off_t list_offset;
+
+static int fill_page(void* buf, const char* name, const struct stat* st, off_t off) {
+    (void) buf;
+    (void) name;
+    (void) st;
+    if (listed == BENCH_READDIR_PAGE) return 1;
+    listed++;
+    list_offset = off;
+    return 0;
+}
+
+//mknod, getattr (in random order, half of them missing), a paged listing and unlink in one directory with many files
+static void bench_bigdir() {
+    char path[32];
+    struct stat st;
+    int f, res;
+
+    if ((res = oper.mkdir("/big", 0755)) != 0) fail("mkdir", "/big", res);
+    phase_begin("bigdir");
+    for (f = 0; f < BENCH_BIG_DIR_FILES; f++) {
+        sprintf(path, "/big/f%d.dat", f);
+        if ((res = oper.mknod(path, S_IFREG | 0666, 0)) != 0) fail("mknod", path, res);
+    }
+    phase_end("mknod", OP_MKNOD);
+
+    phase_begin("bigdir");
+    for (f = 0; f < BENCH_BIG_DIR_FILES; f++) {
+        sprintf(path, "/big/f%d.dat", (int) (next_random() % (2 * BENCH_BIG_DIR_FILES)));
+        oper.getattr(path, &st);
+    }
+    phase_end("getattr", OP_GETATTR);
+
+    phase_begin("bigdir");
+    list_offset = 0;
+    do {
+        listed = 0;
+        if ((res = oper.readdir("/big", NULL, fill_page, list_offset, NULL)) != 0) fail("readdir", "/big", res);
+    } while (listed == BENCH_READDIR_PAGE);
+    phase_end("readdir", OP_READDIR);
+
+    phase_begin("bigdir");
+    for (f = 0; f < BENCH_BIG_DIR_FILES; f++) {
+        sprintf(path, "/big/f%d.dat", f);
+        if ((res = oper.unlink(path)) != 0) fail("unlink", path, res);
+    }
+    phase_end("unlink", OP_UNLINK);
+}
+
+//creates, reads and deletes a directory tree full of files of a few hundred bytes
+static void bench_small() {
+    char buf[BENCH_SMALL_BYTES];
+    char path[32];
+    struct fuse_file_info fi;
+    int d, f, res;
+    int files = (int) (FILES_PER_RECORD);
+
+    memset(buf, 0x3c, sizeof(buf));
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        sprintf(path, "/s%d", d);
+        if ((res = oper.mkdir(path, 0755)) != 0) fail("mkdir", path, res);
+    }
+    int free_before = free_index.nfree;
+
+    phase_begin("small");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        for (f = 0; f < files; f++) {
+            sprintf(path, "/s%d/f%d.cfg", d, f);
+            create_file(path, &fi);
+            write_at(path, buf, 1 + next_random() % BENCH_SMALL_BYTES, 0, &fi);
+            close_file_handle(path, &fi);
+        }
+    }
+    phase_end("write", OP_WRITE);
+    printf("scenario=small phase=space block_size=%d files=%d blocks_used=%d\n", block_size, BENCH_META_DIRS * files,
+            free_before - free_index.nfree);
+
+    phase_begin("small");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        for (f = 0; f < files; f++) {
+            sprintf(path, "/s%d/f%d.cfg", d, f);
+            if ((res = oper.read(path, buf, sizeof(buf), 0, NULL)) < 0) fail("read", path, res);
+        }
+    }
+    phase_end("read", OP_READ);
+
+    phase_begin("small");
+    for (d = 0; d < BENCH_META_DIRS; d++) {
+        for (f = 0; f < files; f++) {
+            sprintf(path, "/s%d/f%d.cfg", d, f);
+            if ((res = oper.unlink(path)) != 0) fail("unlink", path, res);
+        }
+    }
+    phase_end("unlink", OP_UNLINK);
+}
+
+//writes and reads back a file front to back with requests of several sizes
+static void bench_sequential() {
+    static const int sizes_kb[] = { 4, 64, 1024 };
+    char* buf = malloc(1024 * 1024);
+    char path[32], phase[32];
+    struct fuse_file_info fi;
+    int s;
+    off_t off;
+
+    memset(buf, 0x5a, 1024 * 1024);
+    if (oper.mkdir("/seq", 0755) != 0) fail("mkdir", "/seq", -EIO);
+    for (s = 0; s < 3; s++) {
+        size_t size = sizes_kb[s] * 1024;
+        sprintf(path, "/seq/f%d.dat", s);
+        create_file(path, &fi);
+
+        phase_begin("sequential");
+        for (off = 0; off < (off_t) BENCH_FILE_KB * 1024; off += size) {
+            write_at(path, buf, size, off, &fi);
+        }
+        oper.flush(path, &fi);
+        sprintf(phase, "write_%dk", sizes_kb[s]);
+        phase_end(phase, OP_WRITE);
+
+        phase_begin("sequential");
+        for (off = 0; off < (off_t) BENCH_FILE_KB * 1024; off += size) {
+            read_at(path, buf, size, off, &fi);
+        }
+        sprintf(phase, "read_%dk", sizes_kb[s]);
+        phase_end(phase, OP_READ);
+
+        close_file_handle(path, &fi);
+    }
+    free(buf);
+}
+
+//reads and writes at random aligned offsets of a file which is already written
+static void bench_random() {
+    static const int sizes_kb[] = { 4, 64 };
+    char* buf = malloc(1024 * 1024);
+    char phase[32];
+    const char* path = "/rand/f.dat";
+    struct fuse_file_info fi;
+    int s, i;
+    off_t off;
+
+    memset(buf, 0x3c, 1024 * 1024);
+    if (oper.mkdir("/rand", 0755) != 0) fail("mkdir", "/rand", -EIO);
+    create_file(path, &fi);
+    for (off = 0; off < (off_t) BENCH_FILE_KB * 1024; off += 1024 * 1024) {
+        write_at(path, buf, 1024 * 1024, off, &fi);
+    }
+    oper.flush(path, &fi);
+
+    for (s = 0; s < 2; s++) {
+        size_t size = sizes_kb[s] * 1024;
+        int slots = BENCH_FILE_KB / sizes_kb[s];
+
+        phase_begin("random");
+        for (i = 0; i < BENCH_RANDOM_OPS; i++) {
+            write_at(path, buf, size, (off_t) (next_random() % slots) * size, &fi);
+        }
+        oper.flush(path, &fi);
+        sprintf(phase, "write_%dk", sizes_kb[s]);
+        phase_end(phase, OP_WRITE);
+
+        phase_begin("random");
+        for (i = 0; i < BENCH_RANDOM_OPS; i++) {
+            read_at(path, buf, size, (off_t) (next_random() % slots) * size, &fi);
+        }
+        sprintf(phase, "read_%dk", sizes_kb[s]);
+        phase_end(phase, OP_READ);
+    }
+    close_file_handle(path, &fi);
+    free(buf);
+}
+
+//writes 4 KiB pieces at random offsets of a sparse file much larger than the image, out of order so most of them
+//land past the end or in a hole, then reads at random offsets which mostly hit holes
+static void bench_sparse() {
+    char buf[64 * 1024];
+    const char* path = "/sparse/f.dat";
+    struct fuse_file_info fi;
+    off_t slots = (off_t) BENCH_SPARSE_MB * 1024 * 1024 / sizeof(buf);
+    int i;
+
+    memset(buf, 0x5a, sizeof(buf));
+    if (oper.mkdir("/sparse", 0755) != 0) fail("mkdir", "/sparse", -EIO);
+    create_file(path, &fi);
+    phase_begin("sparse");
+    for (i = 0; i < BENCH_RANDOM_OPS; i++) {
+        write_at(path, buf, 4096, (off_t) (next_random() % slots) * sizeof(buf), &fi);
+    }
+    oper.flush(path, &fi);
+    phase_end("write_4k", OP_WRITE);
+
+    phase_begin("sparse");
+    for (i = 0; i < BENCH_RANDOM_OPS; i++) {
+        read_at(path, buf, sizeof(buf), (off_t) (next_random() % slots) * sizeof(buf), &fi);
+    }
+    phase_end("read_64k", OP_READ);
+    close_file_handle(path, &fi);
+}
+
+//appends BENCH_APPEND_KB to each of the open files in turn, 4 KiB at a time, then closes them
+static void append_files(const char* scenario, char path[][32], struct fuse_file_info* fi) {
+    char buf[4096];
+    int f;
+    off_t off;
+
+    memset(buf, 0x77, sizeof(buf));
+    phase_begin(scenario);
+    for (off = 0; off < (off_t) BENCH_APPEND_KB * 1024; off += sizeof(buf)) {
+        for (f = 0; f < BENCH_APPEND_FILES; f++) {
+            write_at(path[f], buf, sizeof(buf), off, &fi[f]);
+        }
+    }
+    for (f = 0; f < BENCH_APPEND_FILES; f++) {
+        close_file_handle(path[f], &fi[f]);
+    }
+    phase_end("write_4k", OP_WRITE);
+
+    phase_begin(scenario);
+    for (f = 0; f < BENCH_APPEND_FILES; f++) {
+        create_file(path[f], &fi[f]);
+        for (off = 0; off < (off_t) BENCH_APPEND_KB * 1024; off += 64 * 1024) {
+            char rbuf[64 * 1024];
+            read_at(path[f], rbuf, sizeof(rbuf), off, &fi[f]);
+        }
+        close_file_handle(path[f], &fi[f]);
+    }
+    phase_end("read_64k", OP_READ);
+}
+
+//grows several open files in turn by small appends and reads each of them back whole. scenario preallocated does
+//it again after truncating them and reserving their final size with fallocate
+static void bench_append() {
+    char path[BENCH_APPEND_FILES][32];
+    struct fuse_file_info fi[BENCH_APPEND_FILES];
+    int f;
+
+    if (oper.mkdir("/app", 0755) != 0) fail("mkdir", "/app", -EIO);
+    for (f = 0; f < BENCH_APPEND_FILES; f++) {
+        sprintf(path[f], "/app/f%d.log", f);
+        create_file(path[f], &fi[f]);
+    }
+    append_files("append", path, fi);
+
+    phase_begin("preallocated");
+    for (f = 0; f < BENCH_APPEND_FILES; f++) {
+        create_file(path[f], &fi[f]);
+        int res = oper.ftruncate(path[f], 0, &fi[f]);
+        if (res != 0) fail("ftruncate", path[f], res);
+        res = oper.fallocate(path[f], FALLOC_FL_KEEP_SIZE, 0, (off_t) BENCH_APPEND_KB * 1024, &fi[f]);
+        if (res != 0) fail("fallocate", path[f], res);
+    }
+    phase_end("fallocate", OP_FALLOCATE);
+    append_files("preallocated", path, fi);
+}
+
+//creates and deletes files of random sizes until the free space is chopped up, then writes and reads a large file.
+//scenario defragment runs one unthrottled defragmenter pass in between
+static void age_image(const char* scenario, int defragment) {
+    char* buf = malloc(256 * 1024);
+    char path[32];
+    struct fuse_file_info fi;
+    int round, d;
+    int files = (int) (FILES_PER_RECORD);
+    int dirs_used = 64;
+    off_t off;
+
+    memset(buf, 0x11, 256 * 1024);
+    for (d = 0; d < dirs_used; d++) {
+        sprintf(path, "/a%d", d);
+        if (oper.mkdir(path, 0755) != 0) fail("mkdir", path, -EIO);
+    }
+
+    phase_begin(scenario);
+    for (round = 0; round < BENCH_AGING_ROUNDS; round++) {
+        uint64_t r = next_random();
+        sprintf(path, "/a%d/f%d.dat", (int) (r % dirs_used), (int) ((r >> 8) % files));
+        if (oper.unlink(path) == 0) continue; //every other visit to a name frees it again
+        size_t size = 4096 * (1 + (r >> 16) % 64);
+        create_file(path, &fi);
+        int res = oper.write(path, buf, size, 0, &fi);
+        close_file_handle(path, &fi);
+        if (res == -ENOSPC) oper.unlink(path);
+    }
+    phase_end("churn_write", OP_WRITE);
+
+    if (defragment) {
+        phase_begin(scenario);
+        int moved = defrag_pass(0);
+        printf("scenario=%s phase=defrag block_size=%d secs=%.4f files_moved=%d blocks_moved=%llu free_runs=%d "
+                "largest_free_run=%d\n", scenario, block_size, seconds_since(&phase_start), moved,
+                (unsigned long long) stats.defrag_blocks, free_index.nextents, free_largest_run());
+        fflush(stdout);
+    }
+
+    if (oper.mkdir("/big", 0755) != 0) fail("mkdir", "/big", -EIO);
+    create_file("/big/f.dat", &fi);
+    phase_begin(scenario);
+    for (off = 0; off < (off_t) BENCH_FILE_KB * 1024 / 2; off += 256 * 1024) {
+        write_at("/big/f.dat", buf, 256 * 1024, off, &fi);
+    }
+    oper.flush("/big/f.dat", &fi);
+    phase_end("write_256k", OP_WRITE);
+
+    phase_begin(scenario);
+    for (off = 0; off < (off_t) BENCH_FILE_KB * 1024 / 2; off += 256 * 1024) {
+        read_at("/big/f.dat", buf, 256 * 1024, off, &fi);
+    }
+    phase_end("read_256k", OP_READ);
+    close_file_handle("/big/f.dat", &fi);
+    free(buf);
+}
+
+static void bench_aging() {
+    age_image("aging", 0);
+}
+
+static void bench_defrag() {
+    age_image("defrag", 1);
+}
+
+//size and contents of the file which thread t writes in round r of the concurrent scenario
+static size_t thread_file(int t, int r, char* buf) {
+    size_t size = (size_t) (r * 997 + t * 131) % BENCH_THREAD_BYTES + 1;
+    size_t k;
+    for (k = 0; k < size; k++) {
+        buf[k] = (char) (t * 31 + r * 7 + k / 13);
+    }
+    return size;
+}
+
+//readdir filler which counts the entries and looks for one name
+struct thread_listing {
+    const char* name;
+    int entries;
+    int found;
+};
+
+static int find_entry(void* buf, const char* name, const struct stat* st, off_t off) {
+    struct thread_listing* listing = buf;
+    (void) st;
+    (void) off;
+    listing->entries++;
+    if (strcmp(name, listing->name) == 0) listing->found = 1;
+    return 0;
+}
+
+//one thread of the concurrent scenario: files go to its own directory and the shared one in turn. a name is used
+//again every BENCH_THREAD_FILES rounds, and what the round before left in it is checked before it is unlinked
+static void* thread_worker(void* arg) {
+    int t = (int) (intptr_t) arg;
+    char path[32], name[16];
+    char buf[BENCH_THREAD_BYTES], rb[BENCH_THREAD_BYTES + 1];
+    struct fuse_file_info fi;
+    struct stat st;
+    int r, res;
+
+    for (r = 0; r < BENCH_THREAD_ROUNDS + BENCH_THREAD_FILES; r++) {
+        const char* dir = r % 2 ? "/shared" : NULL;
+        char own[16];
+        sprintf(own, "/t%d", t);
+        sprintf(name, "t%d_%d.dat", t, r % BENCH_THREAD_FILES);
+        sprintf(path, "%s/%s", dir != NULL ? dir : own, name);
+        if (r >= BENCH_THREAD_FILES) {
+            size_t size = thread_file(t, r - BENCH_THREAD_FILES, buf);
+            res = oper.read(path, rb, sizeof(rb), 0, NULL);
+            if (res < 0) fail("read", path, res);
+            if (res != (int) size || memcmp(rb, buf, size) != 0) {
+                fprintf(stderr, "bench: %s reads %d bytes which differ from the %zu written\n", path, res, size);
+                exit(1);
+            }
+            if ((res = oper.unlink(path)) != 0) fail("unlink", path, res);
+        }
+        if (r >= BENCH_THREAD_ROUNDS) continue;
+
+        size_t size = thread_file(t, r, buf);
+        create_file(path, &fi);
+        write_at(path, buf, size, 0, &fi);
+        close_file_handle(path, &fi);
+        if ((res = oper.getattr(path, &st)) != 0) fail("getattr", path, res);
+        if (st.st_size != (off_t) size) {
+            fprintf(stderr, "bench: %s has size %lld instead of %zu\n", path, (long long) st.st_size, size);
+            exit(1);
+        }
+        if (r % BENCH_THREAD_FILES == 0) {
+            struct thread_listing listing = { .name = name };
+            if ((res = oper.readdir(dir != NULL ? dir : own, &listing, find_entry, 0, NULL)) != 0) fail("readdir", path, res);
+            if (!listing.found) {
+                fprintf(stderr, "bench: %s is missing from a listing of %d entries\n", path, listing.entries);
+                exit(1);
+            }
+        }
+    }
+    return NULL;
+}
+
+//BENCH_THREADS threads create, write, read back, stat, list and unlink files at once, in directories of their own
+//and in one they all share
+static void bench_threads() {
+    pthread_t threads[BENCH_THREADS];
+    char path[32];
+    int t, res;
+
+    if ((res = oper.mkdir("/shared", 0755)) != 0) fail("mkdir", "/shared", res);
+    for (t = 0; t < BENCH_THREADS; t++) {
+        sprintf(path, "/t%d", t);
+        if ((res = oper.mkdir(path, 0755)) != 0) fail("mkdir", path, res);
+    }
+    phase_begin("threads");
+    for (t = 0; t < BENCH_THREADS; t++) {
+        pthread_create(&threads[t], NULL, thread_worker, (void*) (intptr_t) t);
+    }
+    for (t = 0; t < BENCH_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    phase_end("mknod", OP_MKNOD);
+    phase_end("write", OP_WRITE);
+    phase_end("read", OP_READ);
+    phase_end("getattr", OP_GETATTR);
+    phase_end("readdir", OP_READDIR);
+    phase_end("unlink", OP_UNLINK);
+}
+
+//copies a file of the directory bench was started in to the scratch directory
+static void copy_sample(const char* name) {
+    char path[PATH_MAX + 16];
+    char buf[4096];
+    size_t n;
+
+    snprintf(path, sizeof(path), "%s/%s", start_dir, name);
+    FILE* in = fopen(path, "rb");
+    FILE* out = fopen(name, "wb");
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "bench: cannot copy %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+//mounts a copy of the sample image which comes with the sources, from before extents and the superblock, and reads a
+//file of it back: once as it is and once more after the remount which finds .dir in the current format
+static void bench_sample() {
+    static const char expected[] = "I'm a doge";
+    char buf[64];
+    struct stat st;
+    int round, res;
+
+    oper.destroy(NULL);
+    copy_sample(".disk");
+    copy_sample(".dir");
+    unlink(".journal");
+    for (round = 0; round < 2; round++) {
+        oper.init(NULL);
+        phase_begin("sample");
+        if ((res = oper.getattr("/nd/d.txt", &st)) != 0) fail("getattr", "/nd/d.txt", res);
+        res = oper.read("/nd/d.txt", buf, sizeof(buf), 0, NULL);
+        if (res < 0) fail("read", "/nd/d.txt", res);
+        if (res < (int) strlen(expected) || memcmp(buf, expected, strlen(expected)) != 0) {
+            fprintf(stderr, "bench: /nd/d.txt of the sample image reads \"%.*s\"\n", res, buf);
+            exit(1);
+        }
+        phase_end(round == 0 ? "read" : "read_remounted", OP_READ);
+        if (round == 0) oper.destroy(NULL);
+    }
+}
+
+static struct bench_scenario scenarios[] = {
+    { "meta", bench_meta },
+    { "bigdir", bench_bigdir },
+    { "small", bench_small },
+    { "sequential", bench_sequential },
+    { "random", bench_random },
+    { "sparse", bench_sparse },
+    { "append", bench_append },
+    { "aging", bench_aging },
+    { "defrag", bench_defrag },
+    { "threads", bench_threads },
+    { "sample", bench_sample },
+};
+
+#define NSCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void usage() {
+    fprintf(stderr, "usage: bench [-d scratch_dir] [-s image_mb] [-b block_size] [-D] [-U] [-m members] [scenario...]\n"
+            "  -D  open the image with O_DIRECT\n  -U  do the I/O on the image through io_uring\n"
+            "  -m  stripe the image over this many files\nscenarios:");
+    int i;
+    for (i = 0; i < NSCENARIOS; i++) {
+        fprintf(stderr, " %s", scenarios[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int c, i, a;
+    while ((c = getopt(argc, argv, "d:s:b:DUm:h")) != -1) {
+        if (c == 'd') {
+            scratch_dir = optarg;
+        } else if (c == 's') {
+            image_mb = atoi(optarg);
+        } else if (c == 'b') {
+            image_block_size = atoi(optarg);
+        } else if (c == 'D') {
+            options.direct = 1;
+        } else if (c == 'U') {
+            options.uring = 1;
+        } else if (c == 'm') {
+            image_members = atoi(optarg);
+        } else {
+            usage();
+        }
+    }
+    if (image_mb <= 0 || image_members < 1 || image_members > MAX_MEMBERS) usage();
+    for (a = optind; a < argc; a++) {
+        for (i = 0; i < NSCENARIOS && strcmp(argv[a], scenarios[i].name) != 0; i++);
+        if (i == NSCENARIOS) usage();
+    }
+
+    if (getcwd(start_dir, sizeof(start_dir)) == NULL) {
+        fprintf(stderr, "bench: cannot find the current directory: %s\n", strerror(errno));
+        return 1;
+    }
+    mkdir(scratch_dir, 0755);
+    if (chdir(scratch_dir) == -1) {
+        fprintf(stderr, "bench: cannot enter %s: %s\n", scratch_dir, strerror(errno));
+        return 1;
+    }
+    options.log_level = LOG_WARN;
+    options.defrag_interval = 0; //only the defrag scenario moves files, and only when it says so
+
+    for (i = 0; i < NSCENARIOS; i++) {
+        int wanted = optind == argc;
+        for (a = optind; a < argc; a++) {
+            if (strcmp(argv[a], scenarios[i].name) == 0) wanted = 1;
+        }
+        if (!wanted) continue;
+
+        mount_scratch();
+        scenarios[i].run();
+        oper.destroy(NULL);
+    }
+    return 0;
+}
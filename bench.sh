@@ -0,0 +1,3 @@
+rm ./bench
+gcc -O2 bench.c -o bench -lfuse -lpthread
+./bench "$@" | tee bench_output.txt
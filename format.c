@@ -0,0 +1,92 @@
+//Formats an image for mkfs offline: writes .disk with a superblock and an empty bitmap, and empty .dir and .journal.
+//with -S the volume is striped over .disk and one more file for each -S
+#define MKFS_NO_MAIN
+#include "mkfs.c"
+
+#include <getopt.h>
+
+static void usage() {
+    fprintf(stderr, "usage: format [-d dir] [-b block_size] [-p] [-S path]... [-u stripe_unit] <size>[K|M|G]\n"
+            "  -d dir          where .disk, .dir and .journal are created (the current directory by default)\n"
+            "  -b block_size   bytes in a block, a power of two from %d to %d (%d by default)\n"
+            "  -p              allocate all blocks of .disk up front\n"
+            "  -S path         stripe the volume over one more file, created at path and linked as .disk.N\n"
+            "                  (up to %d files, a relative path is taken from dir)\n"
+            "  -u stripe_unit  bytes of a stripe unit, a power of two from 4K and at least a block (%dK by default)\n",
+            MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, DEFAULT_BLOCK_SIZE, MAX_MEMBERS, STRIPE_KB);
+    exit(2);
+}
+
+//parses a size like 512K, 64M or 2G into bytes, returns -1 if it is not one
+static off_t parse_size(const char* text) {
+    char* end;
+    long long n = strtoll(text, &end, 10);
+    if (end == text || n <= 0) return -1;
+    switch (*end) {
+    case 'G': case 'g':
+        n *= 1024; //fall through
+    case 'M': case 'm':
+        n *= 1024; //fall through
+    case 'K': case 'k':
+        n *= 1024;
+        end++;
+    }
+    return *end == 0 ? n : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char* dir = NULL;
+    int preallocate = 0;
+    int bsize = DEFAULT_BLOCK_SIZE;
+    const char* paths[MAX_MEMBERS];
+    int nmembers = 1;
+    off_t stripe_unit = STRIPE_KB * 1024;
+    int c;
+    while ((c = getopt(argc, argv, "d:b:pS:u:h")) != -1) {
+        if (c == 'd') {
+            dir = optarg;
+        } else if (c == 'b') {
+            off_t b = parse_size(optarg);
+            if (b < MIN_BLOCK_SIZE || b > MAX_BLOCK_SIZE || (b & (b - 1)) != 0) usage();
+            bsize = b;
+        } else if (c == 'p') {
+            preallocate = 1;
+        } else if (c == 'S') {
+            if (nmembers == MAX_MEMBERS) usage();
+            paths[nmembers++ - 1] = optarg;
+        } else if (c == 'u') {
+            stripe_unit = parse_size(optarg);
+            if (stripe_unit < DIRECT_ALIGN || stripe_unit > INT32_MAX || (stripe_unit & (stripe_unit - 1)) != 0) usage();
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc - 1) usage();
+    off_t size = parse_size(argv[optind]);
+    if (size == -1) usage();
+    if (nmembers > 1 && stripe_unit < bsize) usage();
+
+    if (dir != NULL && chdir(dir) == -1) {
+        fprintf(stderr, "format: cannot enter %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int res = format_volume(size, bsize, preallocate, paths, nmembers, stripe_unit);
+    if (res != 0) {
+        fprintf(stderr, "format: %s\n", strerror(-res));
+        return 1;
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct mkfs_superblock sb;
+    int fd = open(".disk", O_RDONLY);
+    pread(fd, &sb, sizeof(sb), 0);
+    close(fd);
+    printf("%u blocks of %u bytes, bitmap %u blocks, %u blocks free, formatted in %.1f ms\n", sb.nblocks, sb.block_size,
+            sb.nblocks_bitmap, sb.free_blocks, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    if (nmembers > 1) printf("striped over %d files in units of %u KiB\n", sb.nmembers, sb.stripe_blocks * sb.block_size / 1024);
+    return 0;
+}
@@ -0,0 +1,3 @@
+rm ./format
+gcc format.c -o format -lfuse -lpthread
+./format "$@"
@@ -1,73 +1,876 @@
 #define FUSE_USE_VERSION  26
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 //----------------------------------------------------------------------------------------------------------------->
-//Size of a disk block
-#define BLOCK_SIZE 512
+//Size of a disk block: chosen when the image is formatted, images without a superblock use DEFAULT_BLOCK_SIZE
+#define DEFAULT_BLOCK_SIZE 512
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+//Size of one directory record in .dir, which does not depend on the block size of .disk
+#define DIR_RECORD_SIZE 512
+
+//Marks the first record of .dir, which names no directory and holds DIR_VERSION in nPage. A .dir without it is
+//from before nPage and the flags of a file, whose bytes were padding then
+#define DIR_MAGIC 0x52494444
+#define DIR_VERSION 1
 
 #define MAX_FILENAME 8
 #define MAX_EXTENSION 3
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - (MAX_FILENAME + 1) - sizeof(int)) / \
-    ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+//How many extents are kept in the directory record itself?
+#define MAX_INLINE_EXTENTS 2
+
+//How many files fit in one directory record?
+#define FILES_PER_RECORD ((DIR_RECORD_SIZE - (MAX_FILENAME + 1) - 1 - sizeof(short) - sizeof(int)) / sizeof(struct mkfs_file_directory))
+
+//How many records can one directory span, and so how many files can there be in one directory?
+#define MAX_DIR_RECORDS 65536
+#define MAX_FILES_IN_DIR (FILES_PER_RECORD * MAX_DIR_RECORDS)
+
+//Largest file, block numbers in a file are ints
+#define MAX_FILE_SIZE ((off_t) INT_MAX * block_size)
+
+//How many files a record of .dir held before extents. A .dir of such records is converted when it is mounted
+#define ORIGINAL_FILES_IN_DIR 17
+
+//How many extents fit in one indirect extent block?
+#define MAX_EXTENTS_IN_BLOCK ((int) ((block_size - 2 * sizeof(int)) / sizeof(struct mkfs_extent)))
+
+//How many bits of the bitmap fit in one word?
+#define BITS_IN_WORD 64
+
+//How long (in seconds) the kernel may keep attributes, names and failed lookups. every change goes through the
+//mount, so they are only stale when the image is changed behind its back
+#define ATTR_TIMEOUT 60
+#define ENTRY_TIMEOUT 60
+
+//How often (in seconds) dirty metadata (bitmap and directory records) is written back
+#define FLUSH_INTERVAL 5
+
+//Log levels. Messages above MKFS_LOG_LEVEL are compiled out, the rest can be switched off at mount with log_level=
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+#ifndef MKFS_LOG_LEVEL
+#define MKFS_LOG_LEVEL LOG_TRACE
+#endif
+
+//How many messages the log ring holds (a power of two) and how long one message can be
+#define LOG_SLOTS 4096
+#define LOG_LINE 200
+
+#define log_at(level, ...) do { \
+        if ((level) <= MKFS_LOG_LEVEL && (level) <= options.log_level) log_message((level), __VA_ARGS__); \
+    } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+
+//Read-only virtual file with the statistics of the mount
+#define STATS_PATH "/.stats"
+
+//Virtual file which shows what the defragmenter did, writing to it starts a pass now
+#define DEFRAG_PATH "/.defrag"
+
+//How often (in seconds) the defragmenter makes a pass unless given at mount, 0 only runs it on demand
+#define DEFRAG_INTERVAL 60
+
+//Most data (in KiB) the defragmenter moves per second
+#define DEFRAG_RATE_KB 8192
+
+//Foreground calls per DEFRAG_NAP_MS above which the defragmenter backs off
+#define DEFRAG_BUSY_OPS 64
+#define DEFRAG_NAP_MS 100
+
+//How much data (in KiB) the defragmenter copies at once
+#define DEFRAG_CHUNK_KB 1024
+
+//Latency histogram buckets: exact below 8 ns, then 8 buckets for every power of two (12.5% resolution) up to 2^41 ns
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS 320
+
+//How long the text of /.stats can get
+#define STATS_TEXT 16384
+
+//FUSE callbacks which are timed
+#define OP_GETATTR 0
+#define OP_READDIR 1
+#define OP_MKDIR 2
+#define OP_RMDIR 3
+#define OP_MKNOD 4
+#define OP_UNLINK 5
+#define OP_READ 6
+#define OP_WRITE 7
+#define OP_READ_BUF 8
+#define OP_WRITE_BUF 9
+#define OP_OPEN 10
+#define OP_FLUSH 11
+#define OP_RELEASE 12
+#define OP_FSYNC 13
+#define OP_TRUNCATE 14
+#define OP_FTRUNCATE 15
+#define OP_FALLOCATE 16
+#define OP_COUNT 17
+
+//Marks a superblock in block 0 of .disk. Its lowest bit is clear, which block 0 of an image from before the
+//superblock never has once its bitmap exists
+#define SUPER_MAGIC 0x4d4b5342
+#define SUPER_VERSION 1
+
+//Version of the superblock of a volume striped over several image files, so that builds which only know .disk
+//do not mount a part of it
+#define SUPER_VERSION_STRIPED 2
+
+//Most image files a volume can be striped over
+#define MAX_MEMBERS 64
+
+//Size (in KiB) of a stripe unit unless the formatter is given one
+#define STRIPE_KB 64
+
+//Marks a transaction in .journal
+#define JOURNAL_MAGIC 0x4d4b4a4c
+
+//Where a logged metadata write goes
+#define TARGET_DISK 0
+#define TARGET_DIR 1
+
+//How many hash chains index the files of a new directory? They double whenever there are more files than chains
+#define FILE_BUCKETS 16
+
+//Size (in KiB) of the block cache and of the largest readahead window unless given at mount
+#define CACHE_SIZE_KB 1024
+#define READAHEAD_KB 256
+
+//Size (in blocks) of the first readahead window of a sequential stream, it doubles on every readahead
+#define READAHEAD_MIN 16
 
-//How much data can one block hold?
-#define MAX_DATA_IN_BLOCK (BLOCK_SIZE)
+//How many reads in a row have to start where the previous one ended before readahead starts
+#define SEQUENTIAL_READS 2
 
+//How many readahead requests can wait for the readahead thread
+#define READAHEAD_QUEUE 64
+
+//How much written data (in KiB) may wait for its blocks across all files unless given at mount
+#define DELALLOC_KB 16384
+
+//How much written data (in KiB) one open file may keep before its blocks are allocated
+#define DELALLOC_FILE_KB 4096
+
+//How old (in seconds) buffered data may get before the flusher gives it blocks
+#define DELALLOC_AGE 30
+
+//Alignment (in bytes) of the offset, length and memory of every O_DIRECT transfer to .disk, a page covers the
+//logical sector size of any device the image may sit on
+#define DIRECT_ALIGN 4096
+
+//Size (in bytes) of a bounce buffer for O_DIRECT, larger transfers go through it in pieces
+#define DIRECT_CHUNK (256 * 1024)
+
+//How many idle bounce buffers are kept for reuse
+#define DIRECT_POOL 16
+
+//How many locks serialize read-modify-writes of partly written sectors, picked by sector number
+#define DIRECT_LOCKS 64
+
+//Entries in the submission ring of the io_uring engine, also how many transfers it keeps in flight
+#define RING_ENTRIES 128
+
+//Most transfers of one batch: readahead runs taken off the queue at once, or in place writes of a transaction
+#define RING_BATCH 32
+
+//Largest speculative preallocation (in KiB) past the end of a file which is still being appended to
+#define PREALLOC_KB 1024
+
+//Files of up to INLINE_DATA_SIZE bytes keep their data in their directory record, where the extents would be
+#define INLINE_DATA_SIZE (sizeof(int) + MAX_INLINE_EXTENTS * sizeof(struct mkfs_extent))
+
+//Files of up to PACKED_MAX bytes share packed blocks, each one takes a run of the PACKED_FRAGMENTS fragments of a block
+#define PACKED_MAX (block_size / 2)
+#define PACKED_FRAGMENTS 64
+#define FRAGMENT_SIZE (block_size / PACKED_FRAGMENTS)
+
+//How many packed blocks are searched for free fragments before a new packed block is started
+#define PACKED_SCAN 32
+
+//nExtents of a file whose data is in its directory record or in a packed block
+#define DATA_INLINE -1
+#define DATA_PACKED -2
+
+//nStartBlock of an extent which is a hole: its blocks were never written, take no space and read as zeros
+#define HOLE_BLOCK -2
+
+//nStartBlock of an extent whose blocks fallocate reserved but nothing wrote yet: they read as zeros until a write
+//converts them. it encodes the disk block the run starts at, and applied to the encoded value gives that block back
+#define UNWRITTEN_BLOCK(start) (-3 - (start))
+
+//Flags of a file record
+#define FILE_SPARSE 1 //Some of its extents are holes, so its size does not tell how many blocks it takes
+
+//A run of contiguous blocks which belongs to a file
+struct mkfs_extent {
+    int nStartBlock; //Where the run starts on disk
+    int nBlocks; //How many blocks are in the run
+};
+
+struct mkfs_file_directory {
+    char fname[MAX_FILENAME + 1]; //Filename (plus space for nul)
+    char fext[MAX_EXTENSION + 1]; //Extension (plus space for nul)
+    unsigned char flags; //FILE_ flags, in what used to be padding, cleared when a legacy .dir is loaded
+    size_t fsize; //File size
+    int nExtents; //How many extents the file has, or DATA_INLINE or DATA_PACKED for a small file
+    union {
+        struct {
+            int nIndirectBlock; //First indirect extent block, -1 if all extents fit in this record
+            struct mkfs_extent extents[MAX_INLINE_EXTENTS]; //The first extents of the file
+        };
+        struct {
+            int nPackedBlock; //Packed block which holds the data of a DATA_PACKED file
+            int nPackedFragment; //First fragment of the data in it
+        };
+        char data[INLINE_DATA_SIZE]; //The data of a DATA_INLINE file
+    };
+};
+
+//One record of a directory, a directory with more than FILES_PER_RECORD files spans several of them
 struct mkfs_directory_entry {
     char dname[MAX_FILENAME + 1]; //The directory name (plus space for a nul)
-    int nFiles; //How many files are in this directory
+    unsigned char unused;
+    unsigned short nPage; //Which record of the directory this is, 0 for the first one
+    int nFiles; //Slots below this one are in use, a file with an empty fname is a free slot
+    struct mkfs_file_directory files[FILES_PER_RECORD]; //There is an array of these
+};
+
+//Extents past MAX_INLINE_EXTENTS live in a chain of these blocks
+struct mkfs_indirect_block {
+    int nNextBlock; //Next indirect extent block, -1 if this is the last one
+    int nExtents; //How many extents are used in this block
+    struct mkfs_extent extents[]; //MAX_EXTENTS_IN_BLOCK of them fill the rest of the block
+};
 
-    struct mkfs_file_directory {
-        char fname[MAX_FILENAME + 1]; //Filename (plus space for nul)
-        char fext[MAX_EXTENSION + 1]; //Extension (plus space for nul)
-        size_t fsize; //File size
-        long nStartBlock; //Where the first block is on disk
-    } files[MAX_FILES_IN_DIR]; //There is an array of these
+//A record of .dir as it was before extents: every file was one run of blocks
+struct mkfs_original_directory_entry {
+    char dname[MAX_FILENAME + 1];
+    int nFiles;
+    struct {
+        char fname[MAX_FILENAME + 1];
+        char fext[MAX_EXTENSION + 1];
+        size_t fsize;
+        long nStartBlock; //First block of the run, -1 if the file has none
+    } files[ORIGINAL_FILES_IN_DIR];
 };
 
-int last_allocation_start = 0;
+//Size of a block of the mounted image, from its superblock
+int block_size = DEFAULT_BLOCK_SIZE;
 typedef struct mkfs_directory_entry mkfs_directory_entry;
 typedef struct mkfs_file_directory mkfs_file_directory;
+typedef struct mkfs_extent mkfs_extent;
+typedef struct mkfs_indirect_block mkfs_indirect_block;
+
+
+//One message in the log ring
+struct mkfs_log_slot {
+    uint64_t seq; //Equals the position it is written for once the message is in, position + LOG_SLOTS once it is drained
+    int level;
+    struct timespec time;
+    char text[LOG_LINE];
+};
+
+//Bounded lock-free ring of log messages: any thread claims a slot with one compare and swap on head, the log
+//thread drains them in order to the log file. A message which finds the ring full is counted and dropped
+struct mkfs_log {
+    struct mkfs_log_slot slots[LOG_SLOTS];
+    uint64_t head; //Next position to claim
+    uint64_t tail; //Next position to drain, only the log thread moves it
+    uint64_t dropped;
+    int fd;
+    int running;
+    int stop; //Set to drain what is left and stop the log thread
+    pthread_t thread;
+};
+
+struct mkfs_log logger;
+
+//Counters and latency histogram of one FUSE callback
+struct mkfs_op_stats {
+    uint64_t calls;
+    uint64_t errors; //Calls which returned a negative errno
+    uint64_t bytes; //Data read or written
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[STATS_BUCKETS];
+};
+
+//Statistics of the mount, updated with atomic adds so that no callback waits for them
+struct mkfs_stats {
+    struct mkfs_op_stats ops[OP_COUNT];
+    uint64_t bitmap_scans; //Full scans of the bitmap to build the free extent index
+    uint64_t blocks_scanned; //Blocks covered by those scans
+    uint64_t allocations; //Extents handed out by the allocator
+    uint64_t blocks_allocated;
+    uint64_t relocations; //Times a file could not grow in place and continued in a new extent elsewhere
+    uint64_t defrag_files; //Files the defragmenter moved into one extent
+    uint64_t defrag_blocks; //Blocks it moved
+    uint64_t direct_rmw; //Sectors read back from .disk because an O_DIRECT write only covered part of them
+    uint64_t ring_ios; //Transfers done through io_uring
+    uint64_t ring_enters; //io_uring_enter calls which submitted them
+    uint64_t ring_depth; //Most transfers which were in flight at once
+};
+
+struct mkfs_stats stats;
+
+static const char* op_names[OP_COUNT] = { "getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink", "read", "write",
+    "read_buf", "write_buf", "open", "flush", "release", "fsync", "truncate", "ftruncate", "fallocate" };
+
+//.disk, opened once for the life of the mount
+struct mkfs_image {
+    int fd; //.disk, which is also fds[0]
+    int* fds; //Every member of the volume. stripe unit u lives in member u % nmembers, at unit u / nmembers of it
+    int nmembers;
+    off_t stripe_unit; //Bytes of a stripe unit when there is more than one member
+    int stripe_blocks; //The same in blocks, 0 when there is one member
+    int spliceable; //FUSE may be handed .disk as a descriptor: one member and no O_DIRECT
+    char* map; //Read only shared mapping of the whole image, NULL if it could not be mapped
+    off_t size; //Size of the image and of the mapping
+    pthread_rwlock_t lock; //Write locked while the mapping grows
+    int direct; //Opened with O_DIRECT: not mapped, every transfer goes through an aligned bounce buffer
+    pthread_mutex_t rmw_locks[DIRECT_LOCKS]; //Held while a sector which is only partly written is read back and merged
+};
+
+struct mkfs_image image = { .fd = -1, .nmembers = 1, .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+//Idle DIRECT_CHUNK buffers aligned to DIRECT_ALIGN, shared by all O_DIRECT transfers
+struct mkfs_bounce_pool {
+    void* buffers[DIRECT_POOL];
+    int nbuffers;
+    char* region; //DIRECT_POOL buffers in one allocation, registered with the ring; NULL when they are not
+    pthread_mutex_t lock;
+};
+
+struct mkfs_bounce_pool bounce = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//One transfer between memory and the volume
+struct mkfs_io {
+    char* buf;
+    size_t size;
+    off_t offset; //In the volume, or in member once it is split at stripe units
+    int write;
+    int sync; //An fdatasync of member instead of a transfer
+    int member;
+    ssize_t res; //Bytes moved, or -errno, once it is done
+    int* pending; //Transfers of its batch which are not done yet, the last one wakes the caller
+};
+
+//io_uring instance shared by every thread which does I/O on .disk. Callers queue submissions under lock and the
+//one which finds nobody in io_uring_enter submits everything queued so far; a reaper thread takes the completions
+struct mkfs_ring {
+    int fd; //-1 when the engine is off and transfers are plain pread and pwrite
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map; //The same as sq_map when the kernel maps both rings at once
+    size_t cq_map_size;
+    size_t sqes_size;
+    int fixed_buffers; //The bounce region is registered, transfers from it use the fixed opcodes
+    int queued; //Entries written to the ring but not submitted yet
+    int inflight; //Entries submitted or queued whose completion was not reaped
+    int submitting; //A thread is in io_uring_enter for the queued entries
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t done; //Broadcast when a batch completes
+    pthread_cond_t space; //Broadcast when completions make room for more entries
+    pthread_t reaper;
+};
+
+struct mkfs_ring ring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER };
+
+//Block 0 of a formatted .disk: the geometry of the image, so mount does not infer it from the file length.
+//Images without one keep the bitmap in block 0 and take their size from .disk
+struct mkfs_superblock {
+    uint32_t magic; //SUPER_MAGIC
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t nblocks; //How many blocks the image has, the superblock and bitmap included
+    uint32_t bitmap_start; //First block of the bitmap
+    uint32_t nblocks_bitmap; //How many blocks the bitmap takes
+    uint32_t data_start; //First block which can hold data
+    uint32_t free_blocks; //Free blocks when the bitmap was last written back
+    uint64_t created; //When the image was formatted (seconds since the epoch)
+    uint32_t nmembers; //Image files the volume is striped over: .disk, .disk.1, .disk.2 and so on
+    uint32_t stripe_blocks; //Blocks of a stripe unit, 0 for a volume of one file
+};
+
+struct mkfs_superblock super;
+
+//Set in _init when the kernel can splice data between /dev/fuse and .disk
+int splice_read = 0;
+int splice_write = 0;
+
+//Mount options, parsed in main
+struct mkfs_options {
+    int cache_kb; //Size of the block cache, 0 turns it off
+    int readahead_kb; //Largest readahead window, 0 turns readahead off
+    int delalloc_kb; //Written data which may wait for its blocks, 0 allocates on every write
+    char* log_path; //Where the log goes, stderr if it is not given
+    int log_level; //Most detailed level which is logged
+    int defrag_interval; //Seconds between background defragmenter passes, 0 only runs it on demand
+    int direct; //Open .disk with O_DIRECT so that its data is not cached by the host as well
+    int uring; //Do the I/O on .disk through io_uring
+};
+
+struct mkfs_options options = { .cache_kb = CACHE_SIZE_KB, .readahead_kb = READAHEAD_KB, .delalloc_kb = DELALLOC_KB,
+    .log_level = LOG_INFO, .defrag_interval = DEFRAG_INTERVAL };
+
+//States of a block cache slot
+#define SLOT_EMPTY 0
+#define SLOT_VALID 1
+#define SLOT_LOADING 2 //Being read or read ahead, the data is not there yet
+#define SLOT_STALE 3 //Written while it was being read, dropped when the read finishes
+
+//One block of the block cache
+struct mkfs_cache_slot {
+    int block; //Disk block held in the slot
+    int state;
+    int next; //Next slot in the same hash chain, -1 at the end
+    int referenced; //CLOCK reference bit, set on every hit
+};
+
+//Fixed size cache of .disk blocks between the FUSE callbacks and the image, evicted with CLOCK.
+//Writes go through to the image and update the cached copy; a readahead thread fills it ahead of sequential readers
+struct mkfs_cache {
+    char* data; //nslots blocks, slot i at data + i * block_size
+    struct mkfs_cache_slot* slots;
+    int nslots; //0 when the cache is off
+    int* buckets; //First slot of every hash chain, -1 if the chain is empty
+    int nbuckets;
+    int hand; //CLOCK hand
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t read_ahead; //Blocks read by the readahead thread
+    pthread_mutex_t lock;
+    struct mkfs_extent queue[READAHEAD_QUEUE]; //Runs of disk blocks waiting to be read ahead
+    int qhead;
+    int qlen;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int stop; //Set on destroy to stop the readahead thread
+};
+
+struct mkfs_cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+//In-memory copy of the block bitmap stored at the beginning of .disk
+struct mkfs_bitmap {
+    uint64_t* words; //bit i of words[w] describes block w * BITS_IN_WORD + i
+    int nblocks; //How many blocks are on disk
+    int start; //First block of the bitmap in .disk, 1 behind a superblock and 0 without one
+    int nblocks_bitmap; //How many blocks the bitmap itself takes
+    unsigned char* dirty; //One flag per bitmap block which has to be written back
+    int ndirty; //How many bitmap blocks are dirty
+    pthread_mutex_t lock;
+};
+
+struct mkfs_bitmap bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//Treaps of the free extent index
+#define BY_START 0
+#define BY_SIZE 1
+
+//One run of free blocks, kept in both treaps of the free extent index
+struct mkfs_free_extent {
+    int start; //First free block
+    int len; //How many free blocks are in the run
+    unsigned prio; //Treap priority
+    struct mkfs_free_extent* child[2][2]; //Left and right children in the BY_START and BY_SIZE treaps
+};
+
+typedef struct mkfs_free_extent mkfs_free_extent;
+
+//Index of all free runs on disk, guarded by bitmap.lock
+struct mkfs_free_index {
+    mkfs_free_extent* root[2]; //Roots of the BY_START and BY_SIZE treaps
+    int nfree; //How many blocks are free
+    int nextents; //How many free runs there are
+    int reserved; //Free blocks promised to data which waits for its blocks
+};
+
+struct mkfs_free_index free_index;
+
+//A block shared by small files
+struct mkfs_packed_block {
+    int block;
+    uint64_t used; //One bit per fragment which belongs to a file
+};
+
+typedef struct mkfs_packed_block mkfs_packed_block;
+
+//Fragments of a packed block which a file gave up
+struct mkfs_fragment_run {
+    int block;
+    int first;
+    int num_fragments;
+};
+
+typedef struct mkfs_fragment_run mkfs_fragment_run;
+
+//Every packed block, sorted by block number and rebuilt from the directory records in _init
+struct mkfs_packed {
+    mkfs_packed_block* blocks;
+    int nblocks;
+    int capacity;
+    int cursor; //Packed block the search for free fragments starts at
+    mkfs_fragment_run* freed; //Fragments given up in the transaction being built, they are only reused once it is committed
+    int nfreed;
+    int freed_capacity;
+    pthread_mutex_t lock;
+};
+
+struct mkfs_packed packed = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//All extents of one file, loaded from its directory record and indirect extent blocks
+struct mkfs_extent_map {
+    mkfs_extent* extents; //Extents in file order
+    int* ends; //ends[i] is the first block of the file after extent i
+    int nExtents;
+    int capacity;
+    int* indirect; //The indirect extent blocks of the file
+    int nIndirect;
+    int dirty_from; //First extent which changed since the map was loaded or stored
+    int nStored; //How many extents were on disk when the map was loaded or stored
+};
+
+typedef struct mkfs_extent_map mkfs_extent_map;
+
+//In-memory copy of one record of .dir
+struct mkfs_dir_page {
+    mkfs_directory_entry entry; //The record as it is stored in .dir
+    struct mkfs_dir* dir; //Directory the record belongs to
+    int record; //Which record of .dir it is
+    int dirty; //Set when the record has to be written back
+    int used; //How many of its slots hold a file
+    int next[FILES_PER_RECORD]; //Next slot in the same hash chain
+    struct mkfs_open_file* open[FILES_PER_RECORD]; //Open file of every slot, NULL if it is not open
+};
+
+typedef struct mkfs_dir_page mkfs_dir_page;
+
+//One directory and its records. A file is known by its slot, FILES_PER_RECORD slots per record in nPage order,
+//which it keeps until it is unlinked
+struct mkfs_dir {
+    char name[MAX_FILENAME + 1];
+    int index; //Where the directory is in dirs.dirs
+    mkfs_dir_page** pages; //Records of the directory, pages[i] has nPage i. they only go away with the directory
+    int npages;
+    int nfiles; //How many files are in the directory
+    int free_page; //No page before this one has a free slot
+    int* buckets; //First slot of every hash chain, -1 if the chain is empty
+    int nbuckets; //A power of two, at least nfiles
+    struct mkfs_dir* hash_next; //Next directory in the same bucket of the directory table
+    pthread_rwlock_t lock; //Write locked to add, remove or open files, read locked to use them
+};
+
+typedef struct mkfs_dir mkfs_dir;
+
+//One open file, shared by every handle (fuse_file_info->fh) opened on it
+struct mkfs_open_file {
+    mkfs_dir* dir; //Directory of the file, NULL once the file is unlinked
+    int file_index; //Slot of the file in its directory
+    mkfs_file_directory* file; //The record of the file, in its directory or in detached
+    mkfs_file_directory detached; //The record after unlink, the blocks are freed on the last release
+    mkfs_extent_map map; //All extents of the file, loaded once at open
+    int refs; //How many handles are open
+    pthread_rwlock_t lock; //Write locked to change the size or the extents, read locked to read data
+    off_t next_read; //Where the last read ended, to spot sequential streams
+    int seq_reads; //How many reads in a row started where the previous one ended
+    off_t ra_end; //Readahead was queued up to here
+    int ra_window; //Next readahead window in blocks
+    pthread_mutex_t stream_lock; //Guards the stream fields above, reads only hold lock shared
+    char* tail; //Data written past the last allocated block, it gets its blocks on flush (delayed allocation)
+    size_t tail_len;
+    size_t tail_cap;
+    int reserved; //Blocks reserved for the tail and the indirect blocks it may need
+    time_t tail_since; //When the tail started to fill
+    uint64_t generation; //Bumped whenever the data or the extents change, so a copy made without the lock can be checked
+    int fallocated; //Blocks the file keeps when it is closed even past its end, set by fallocate and at open
+};
+
+typedef struct mkfs_open_file mkfs_open_file;
+
+//Every directory of .dir, loaded once in _init and written back in batches.
+//Locks are always taken in the order table, directory, open file, packed blocks, bitmap
+struct mkfs_dir_table {
+    mkfs_dir** dirs;
+    int ndirs;
+    int capacity;
+    mkfs_dir_page** records; //Every record in .dir order
+    int nrecords_used; //How many records there are in memory
+    int records_capacity;
+    int nrecords; //How many records .dir has on disk
+    int header; //Whether .dir starts with its header record on disk
+    mkfs_dir** buckets; //Hash chains of directories by name
+    int nbuckets;
+    int ndirty; //How many records have to be written back
+    pthread_rwlock_t lock; //Write locked to add or remove directories, read locked to use them
+    pthread_mutex_t records_lock; //Guards records, a directory grows by a record with only the table read locked
+    pthread_mutex_t flush_lock; //Serializes flush_dirs()
+};
+
+struct mkfs_dir_table dirs = { .lock = PTHREAD_RWLOCK_INITIALIZER, .records_lock = PTHREAD_MUTEX_INITIALIZER,
+        .flush_lock = PTHREAD_MUTEX_INITIALIZER };
+
+//Header of the transaction in .journal, followed by its records
+struct mkfs_journal_header {
+    uint32_t magic;
+    uint32_t nrecords;
+    uint64_t seq; //Number of the transaction
+    uint64_t len; //Bytes of records after the header
+    uint64_t checksum; //FNV-1a of the records
+};
+
+//One logged write in .journal, followed by len bytes of data
+struct mkfs_journal_record {
+    int32_t target; //TARGET_DISK or TARGET_DIR
+    int32_t len; //-1 truncates the target to offset
+    int64_t offset;
+};
+
+//One metadata write waiting for its transaction
+struct mkfs_journal_entry {
+    int target;
+    int len;
+    off_t offset;
+    char* data;
+};
+
+//Write-ahead log of metadata. Bitmap blocks, directory records and indirect extent blocks are not written in
+//place but collected into a transaction, which is logged to .journal and synced before it is written in place
+struct mkfs_journal {
+    int fd; //.journal
+    int dir_fd; //.dir
+    struct mkfs_journal_entry* pending; //Writes of the transaction being built
+    int npending;
+    int capacity;
+    struct mkfs_journal_entry* committing; //Writes of the transaction being committed
+    int ncommitting;
+    mkfs_extent* freed; //Blocks freed in the transaction being built, they are only reused once it is committed
+    int nfreed;
+    int freed_capacity;
+    uint64_t seq; //Number of the last committed transaction
+    uint64_t started; //How many commits have taken their snapshot
+    uint64_t done; //Which of them finished last
+    pthread_mutex_t lock; //Guards the lists above
+    pthread_mutex_t commit_lock; //Serializes commits
+    pthread_rwlock_t barrier; //Read locked around every metadata change, write locked while a commit takes its snapshot
+};
+
+struct mkfs_journal journal = { .fd = -1, .dir_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .commit_lock = PTHREAD_MUTEX_INITIALIZER };
 
-struct mkfs_disk_block {
-    char data[MAX_DATA_IN_BLOCK]; //Data storage
+//Background thread which writes dirty metadata back every FLUSH_INTERVAL seconds
+struct mkfs_flusher {
+    pthread_t thread;
+    pthread_cond_t wake;
+    pthread_mutex_t lock;
+    int stop; //Set on destroy to stop the thread
 };
 
-typedef struct mkfs_disk_block mkfs_disk_block;
+struct mkfs_flusher flusher = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+//Background thread which moves fragmented files into one extent and files which split free space out of the way
+struct mkfs_defrag {
+    pthread_t thread;
+    pthread_cond_t wake;
+    pthread_mutex_t lock;
+    int stop; //Set on destroy to stop the thread, also ends a pass which is running
+    int requested; //Set to start a pass now
+    pthread_mutex_t pass_lock; //Held for a whole pass, so that only one runs at a time
+    uint64_t passes;
+    uint64_t last_ops; //Foreground calls when the foreground was last checked
+    struct timespec last_check;
+};
+
+struct mkfs_defrag defrag = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+    .pass_lock = PTHREAD_MUTEX_INITIALIZER };
 //----------------------------------------------------------------------------------------------------------------->
 
 //Main functions-------------------------------------------------------------start->
 void parse_path(const char* path, char* directory, char* filename, char* extension);
 void touch(char* path);
 
-int find_file(mkfs_directory_entry* dir, char* file_target, char* ext_target);
-int find_dir(mkfs_directory_entry* dir_struct, char* dir_name);
+void start_logging();
+void log_message(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void stop_logging();
+
+void count_event(uint64_t* counter, uint64_t n);
+void op_done(int op, struct timespec* start, int res, uint64_t bytes);
+size_t render_stats(char* buf, size_t size);
+void dump_stats();
+
+int find_file(mkfs_dir* dir, char* file_target, char* ext_target);
+mkfs_dir* find_dir(char* dir_name);
+mkfs_dir* add_dir(char* dir_name);
+void remove_dir(mkfs_dir* dir);
+int add_file(mkfs_dir* dir, char* fname, char* fext);
+void remove_file(mkfs_dir* dir, int file_index);
+mkfs_file_directory* dir_file(mkfs_dir* dir, int file_index);
+mkfs_open_file** dir_open(mkfs_dir* dir, int file_index);
+int dir_slots(mkfs_dir* dir);
+void mark_dirty(mkfs_dir* dir, int file_index);
+
+mkfs_open_file* open_file(mkfs_dir* dir, int file_index);
+mkfs_open_file* open_path(const char* path);
+void close_file(mkfs_open_file* of);
+mkfs_dir* lock_file_dir(mkfs_open_file* of);
+void unlock_file_dir(mkfs_dir* dir);
+
+void dir_header(mkfs_directory_entry* entry);
+int load_dirs();
+void flush_dirs();
+void release_dirs();
+
+void init_journal();
+void meta_write(int target, const void* buf, size_t size, off_t offset);
+void meta_truncate(int target, off_t size);
+ssize_t meta_read(void* buf, size_t size, off_t offset);
+void free_meta_block(int block);
+void free_after_commit(int start_block, int num_blocks);
+int commit_frees(uint64_t done);
+void journal_begin();
+void journal_end();
+void flush_metadata();
+void close_journal();
+
+void flush_open_files(int max_age);
+void start_flusher();
+void kick_flusher();
+void stop_flusher();
+
+void start_defrag();
+void request_defrag();
+int defrag_pass(int throttled);
+void stop_defrag();
+size_t render_defrag(char* buf, size_t size);
+
+int open_image();
+ssize_t image_read(void* buf, size_t size, off_t offset);
+ssize_t image_write(const void* buf, size_t size, off_t offset);
+void image_rw(struct mkfs_io* ios, int n);
+int open_ring(const int* fds, int nfds);
+void close_ring();
+int sync_image();
+void close_image();
+
+int format_image(off_t size, int bsize, int preallocate);
+int format_volume(off_t size, int bsize, int preallocate, const char** paths, int nmembers, int stripe_unit);
+int load_superblock();
+
+void init_cache(int cache_kb);
+ssize_t cache_read(char* buf, size_t size, off_t offset);
+void cache_write(const char* buf, size_t size, off_t offset);
+void cache_invalidate(off_t offset, size_t size);
+void cache_readahead(int start_block, int num_blocks);
+void release_cache();
 
 int last_bitmap_index();
 int get_state(int block_idx);
 int get_bitmap_size();
 
 void change_bit(int i, int sign);
+void change_range(int start_block, int num_blocks, int sign);
 void set(int i);
 void unset(int i);
 
+void load_bitmap();
+void flush_bitmap();
+void release_bitmap();
+
+void build_free_index();
+void release_free_index();
+
 void allocate(int start_block, int num_blocks);
 void unallocate(int start_block, int num_blocks);
 
-void print_bitmap();
 void check_bitmap();
 
 int find_free_space(int num_blocks);
+int free_largest_run();
+int allocate_extent(int goal, int num_blocks, int* got);
+int reserve_blocks(int num_blocks, int force);
+void unreserve_blocks(int num_blocks);
+
+void load_extents(mkfs_file_directory* file, mkfs_extent_map* map);
+int store_extents(mkfs_file_directory* file, mkfs_extent_map* map);
+void release_extents(mkfs_extent_map* map);
+int map_blocks(mkfs_extent_map* map);
+int map_block(mkfs_extent_map* map, int file_block, int* run);
+int data_blocks(mkfs_extent_map* map);
+int map_sparse(mkfs_extent_map* map, off_t offset, size_t size);
+void set_range(mkfs_extent_map* map, int file_block, int num_blocks, int start_block);
+void zero_range(mkfs_extent_map* map, off_t from, off_t to);
+int fill_holes(mkfs_file_directory* file, mkfs_extent_map* map, off_t offset, size_t size, int reserve);
+int punch_blocks(mkfs_file_directory* file, mkfs_extent_map* map, int file_block, int num_blocks);
+int extend_file(mkfs_extent_map* map, int num_blocks);
+void shrink_file(mkfs_extent_map* map, int num_blocks);
+void free_map(mkfs_extent_map* map);
+void free_file(mkfs_file_directory* file);
+int io_extents(mkfs_extent_map* map, char* buf, size_t size, off_t offset, int write);
+struct fuse_bufvec* extent_bufvec(mkfs_extent_map* map, size_t size, off_t offset);
+void readahead_file(mkfs_open_file* of, off_t offset, size_t size);
+int convert_original_dir();
+
+int grow_tail(mkfs_open_file* of, size_t len);
+int flush_tail(mkfs_open_file* of, mkfs_dir* dir, int speculative);
+int fill_gap(mkfs_open_file* of, mkfs_dir* dir, off_t offset);
+void drop_tail(mkfs_open_file* of);
+void trim_file(mkfs_open_file* of, mkfs_dir* dir);
+
+void load_packed();
+void release_packed();
+int allocate_fragments(int num_fragments, int* first);
+void free_fragments(int block, int first, int num_fragments);
+mkfs_fragment_run* take_freed_fragments(int* n);
+void reuse_fragments(mkfs_fragment_run* runs, int n);
+int read_small(mkfs_file_directory* file, char* buf, size_t size, off_t offset);
+void release_small(mkfs_file_directory* file);
+int pack_file(mkfs_open_file* of, mkfs_dir* dir);
+int unpack_file(mkfs_open_file* of, mkfs_dir* dir);
+blkcnt_t stat_blocks(mkfs_file_directory* file, mkfs_open_file* of);
+
+int resize_file(mkfs_open_file* of, mkfs_dir* dir, off_t size);
+int allocate_file(mkfs_open_file* of, mkfs_dir* dir, off_t offset, off_t len, int keep_size);
+int punch_file(mkfs_open_file* of, mkfs_dir* dir, off_t offset, off_t len);
 //Main functions---------------------------------------------------------------end->
 
 static void *_init(struct fuse_conn_info * conn);
@@ -80,248 +883,4331 @@ static int _mknod(const char *path, mode_t mode, dev_t dev);
 static int _unlink(const char *path);
 static int _read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info * fi);
 static int _write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int _read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+static int _write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
 static int _open(const char *path, struct fuse_file_info *fi);
 static int _flush (const char *path , struct fuse_file_info *fi);
+static int _release(const char *path, struct fuse_file_info *fi);
+static int _fsync(const char *path, int isdatasync, struct fuse_file_info *fi);
 static int _truncate(const char *path, off_t size);
+static int _ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+static int _fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi);
+
+//Defines timed_<name> which calls _<name> and records it under op, bytes is evaluated after the call with res set
+#define TIMED_OP(op, name, params, args, bytes) \
+    static int timed_##name params { \
+        struct timespec start; \
+        clock_gettime(CLOCK_MONOTONIC, &start); \
+        int res = _##name args; \
+        op_done(op, &start, res, bytes); \
+        return res; \
+    }
+
+TIMED_OP(OP_GETATTR, getattr, (const char *path, struct stat *stbuf), (path, stbuf), 0)
+TIMED_OP(OP_READDIR, readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+        (path, buf, filler, offset, fi), 0)
+TIMED_OP(OP_MKDIR, mkdir, (const char *path, mode_t mode), (path, mode), 0)
+TIMED_OP(OP_RMDIR, rmdir, (const char *path), (path), 0)
+TIMED_OP(OP_MKNOD, mknod, (const char *path, mode_t mode, dev_t dev), (path, mode, dev), 0)
+TIMED_OP(OP_UNLINK, unlink, (const char *path), (path), 0)
+TIMED_OP(OP_READ, read, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+        (path, buf, size, offset, fi), res > 0 ? res : 0)
+TIMED_OP(OP_WRITE, write, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+        (path, buf, size, offset, fi), res > 0 ? res : 0)
+TIMED_OP(OP_READ_BUF, read_buf, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi),
+        (path, bufp, size, offset, fi), res == 0 ? fuse_buf_size(*bufp) : 0)
+TIMED_OP(OP_WRITE_BUF, write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi),
+        (path, buf, offset, fi), res > 0 ? res : 0)
+TIMED_OP(OP_OPEN, open, (const char *path, struct fuse_file_info *fi), (path, fi), 0)
+TIMED_OP(OP_FLUSH, flush, (const char *path, struct fuse_file_info *fi), (path, fi), 0)
+TIMED_OP(OP_RELEASE, release, (const char *path, struct fuse_file_info *fi), (path, fi), 0)
+TIMED_OP(OP_FSYNC, fsync, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi), 0)
+TIMED_OP(OP_TRUNCATE, truncate, (const char *path, off_t size), (path, size), 0)
+TIMED_OP(OP_FTRUNCATE, ftruncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi), 0)
+TIMED_OP(OP_FALLOCATE, fallocate, (const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi),
+        (path, mode, offset, len, fi), 0)
 
-static struct fuse_operations oper = {
+//format.c includes this file as well and never calls oper
+static struct fuse_operations oper __attribute__((unused)) = {
     .destroy = _destroy,
     .init = _init,
-    .getattr = _getattr,
-    .readdir = _readdir,
-    .mkdir = _mkdir,
-    .rmdir = _rmdir,
-    .mknod = _mknod,
-    .unlink = _unlink,
-    .read = _read,
-    .write = _write,
-    .open = _open,
-    .flush = _flush,
-    .truncate = _truncate
+    .getattr = timed_getattr,
+    .readdir = timed_readdir,
+    .mkdir = timed_mkdir,
+    .rmdir = timed_rmdir,
+    .mknod = timed_mknod,
+    .unlink = timed_unlink,
+    .read = timed_read,
+    .write = timed_write,
+    .read_buf = timed_read_buf,
+    .write_buf = timed_write_buf,
+    .open = timed_open,
+    .flush = timed_flush,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .truncate = timed_truncate,
+    .ftruncate = timed_ftruncate,
+    .fallocate = timed_fallocate
+};
+
+//bench.c and format.c include this file with MKFS_NO_MAIN, bench.c calls oper itself
+#ifndef MKFS_NO_MAIN
+static struct fuse_opt mkfs_opts[] = {
+    { "cache_size=%d", offsetof(struct mkfs_options, cache_kb), 0 },
+    { "readahead=%d", offsetof(struct mkfs_options, readahead_kb), 0 },
+    { "delalloc=%d", offsetof(struct mkfs_options, delalloc_kb), 0 },
+    { "log=%s", offsetof(struct mkfs_options, log_path), 0 },
+    { "log_level=%d", offsetof(struct mkfs_options, log_level), 0 },
+    { "defrag=%d", offsetof(struct mkfs_options, defrag_interval), 0 },
+    { "odirect", offsetof(struct mkfs_options, direct), 1 },
+    { "uring", offsetof(struct mkfs_options, uring), 1 },
+    FUSE_OPT_END
 };
 
 int main(int argc, char *argv[]) {
-    return fuse_main(argc, argv, &oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, mkfs_opts, NULL) == -1) return 1;
+    //defaults go first, so timeouts given on the command line override them
+    char timeouts[100];
+    snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%d,entry_timeout=%d,negative_timeout=%d", ATTR_TIMEOUT,
+            ENTRY_TIMEOUT, ENTRY_TIMEOUT);
+    if (fuse_opt_insert_arg(&args, 1, timeouts) == -1) return 1;
+    int res = fuse_main(args.argc, args.argv, &oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
+#endif
 
 //Implementation main functions------------------------------------------------------------------------------start->
 void parse_path(const char* path, char* directory, char* filename, char* extension) {
     sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
 }
 
-//returns the index of a file in a directory
-int find_file(mkfs_directory_entry* dir, char* file_target, char* ext_target) {
-    int i;
-    for (i = 0; i < dir->nFiles; i++) {
-        mkfs_file_directory cur_file = dir->files[i];
-        if (strcmp(file_target, cur_file.fname) == 0 && strcmp(ext_target, cur_file.fext) == 0) {
-            return i;
+void touch(char* path) {
+    FILE* f = fopen(path, "a");
+    fclose(f);
+}
+
+//Logging-----------------------------------------------------------------------------------------------start->
+static void init_log_ring() {
+    uint64_t i;
+    for (i = 0; i < LOG_SLOTS; i++) {
+        logger.slots[i].seq = i + LOG_SLOTS; //drained, free for position i
+    }
+    logger.head = logger.tail = 0;
+    logger.dropped = 0;
+}
+
+//queues one message for the log thread, never blocks
+void log_message(int level, const char* format, ...) {
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) return;
+
+    uint64_t pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+    struct mkfs_log_slot* slot;
+    while (1) {
+        slot = &logger.slots[pos & (LOG_SLOTS - 1)];
+        int64_t diff = (int64_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - LOG_SLOTS - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logger.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) { //the log thread is a whole ring behind
+            __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
         }
     }
-    return -1;
+
+    slot->level = level;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, LOG_LINE, format, args);
+    va_end(args);
+    __atomic_store_n(&slot->seq, pos, __ATOMIC_RELEASE);
 }
 
-//returns index of directory entry in .dir
-int find_dir(mkfs_directory_entry* dir_struct, char* dir_name) {
-    FILE* f = fopen(".dir", "rb");
-    fread(dir_struct, sizeof(*dir_struct), 1, f);
-    
-    while (strcmp(dir_struct->dname, dir_name) != 0 && !feof(f)) {
-        int read = fread(dir_struct, sizeof(*dir_struct), 1, f);
-        if (read == 0) break;
+//writes out every message which is in, returns how many there were
+static int drain_log() {
+    static const char* names[] = { "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+    char out[64 * 1024];
+    size_t len = 0;
+    int n = 0;
+    while (1) {
+        struct mkfs_log_slot* slot = &logger.slots[logger.tail & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger.tail) break;
+
+        if (len + LOG_LINE + 64 > sizeof(out)) {
+            write(logger.fd, out, len);
+            len = 0;
+        }
+        struct tm tm;
+        localtime_r(&slot->time.tv_sec, &tm);
+        len += strftime(out + len, sizeof(out) - len, "%H:%M:%S", &tm);
+        len += snprintf(out + len, sizeof(out) - len, ".%06ld %-5s %s\n", slot->time.tv_nsec / 1000, names[slot->level], slot->text);
+        __atomic_store_n(&slot->seq, logger.tail + LOG_SLOTS, __ATOMIC_RELEASE);
+        logger.tail++;
+        n++;
     }
-    
-    if (strcmp(dir_struct->dname, dir_name) == 0) {
-        int result = ftell(f) - sizeof(*dir_struct);
-        fclose(f);
-        return result;
-    } else {
-        fclose(f);
-        return -1;
+
+    uint64_t dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        len += snprintf(out + len, sizeof(out) - len, "%llu log messages dropped\n", (unsigned long long) dropped);
     }
+    if (len > 0) write(logger.fd, out, len);
+    return n;
 }
 
-void touch(char* path) {
-    FILE* f = fopen(path, "a");
-    fclose(f);
+static void* log_main(void* arg) {
+    (void) arg;
+    while (!__atomic_load_n(&logger.stop, __ATOMIC_ACQUIRE)) {
+        if (drain_log() == 0) {
+            struct timespec nap = { 0, 10 * 1000 * 1000 };
+            nanosleep(&nap, NULL);
+        }
+    }
+    drain_log();
+    return NULL;
 }
 
-//return last index of block from bitmap
-int last_bitmap_index() {
-    touch(".disk"); //just in case it wasn't precreated
-    FILE* f = fopen(".disk", "r+b");
-    fseek(f, 0, SEEK_END); //set position of stream to end
-    int bytes_on_disk = ftell(f);
-    int blocks_on_disk = bytes_on_disk / 512;
-    fclose(f);
-    return blocks_on_disk - 1;
+//opens the log (the log= mount option, or stderr) and starts the thread which writes it
+void start_logging() {
+    logger.fd = STDERR_FILENO;
+    if (options.log_path != NULL) {
+        int fd = open(options.log_path, O_WRONLY | O_CREAT | O_APPEND, 0664);
+        if (fd != -1) logger.fd = fd;
+    }
+    init_log_ring();
+    logger.stop = 0;
+    pthread_create(&logger.thread, NULL, log_main, NULL);
+    __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
 }
 
-//returns 1 if the block is allocated, otherwise 0
-int get_state(int block_idx) {
-	FILE* f = fopen(".disk", "r+b");
-	int byte_idx = block_idx / 8;
-	int bit_idx = block_idx % 8;
-	fseek(f, byte_idx, SEEK_SET);
-	unsigned char target_byte;
-	fread(&target_byte, sizeof(char), 1, f);
-	fclose(f);
-	unsigned char operand = 1 << bit_idx;
-	unsigned char result = target_byte & operand;
-	result = result >> bit_idx;
-	return result;
+//writes out what is left and stops the log thread
+void stop_logging() {
+    if (!logger.running) return;
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&logger.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+    if (logger.fd != STDERR_FILENO) close(logger.fd);
 }
+//Logging-------------------------------------------------------------------------------------------------end->
 
-//calculates size (in blocks) of bitmap
-int get_bitmap_size() {
-    touch(".disk"); //just in case it wasn't precreated
-    FILE* f = fopen(".disk", "r+b");
-    fseek(f, 0, SEEK_END);
-    int bytes_on_disk = ftell(f);
-    int blocks_on_disk = bytes_on_disk / 512; //keep as is to round down so you don't have a half sized block at end
-    int bitmap_bytes_needed = blocks_on_disk / 8 + 1;
-    int bitmap_blocks_needed = bitmap_bytes_needed / 512 + 1;
-    fclose(f);
-    return bitmap_blocks_needed;
+//Statistics--------------------------------------------------------------------------------------------start->
+void count_event(uint64_t* counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
 }
 
-void change_bit(int i, int sign) {
-    touch(".disk"); //just in case it wasn't precreated
-    FILE* f = fopen(".disk", "r+b");
-    
-    int byte_to_set = i / 8;
-    i = i % 8;
-    
-    fseek(f, byte_to_set, SEEK_SET);
-    
-    unsigned char curr_byte = 0;
-    fread(&curr_byte, sizeof(char), 1, f);
-    unsigned char operand = 1 << i;
-    if (sign == -1) { //if we are unsetting the bit
-        operand = ~operand;
-        curr_byte = curr_byte & operand;
-    } else { //if we are setting the bit
-        curr_byte = curr_byte | operand;
-    }
-    fseek(f, -1, SEEK_CUR);
-    fwrite(&curr_byte, sizeof(char), 1, f);
-    fclose(f);
-    return;
+static int stats_bucket(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) return ns;
+    int e = 63 - __builtin_clzll(ns);
+    int b = (e - 2) * STATS_SUB_BUCKETS + ((ns >> (e - 3)) & (STATS_SUB_BUCKETS - 1));
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
 }
 
-//wrappers for the change_bit
-void set(int i) { //set the bit to 1
-    change_bit(i, 1);
-    return;
+//the largest latency which lands in bucket b
+static uint64_t bucket_top(int b) {
+    if (b < STATS_SUB_BUCKETS) return b;
+    int e = b / STATS_SUB_BUCKETS + 2;
+    return ((uint64_t) (STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS + 1) << (e - 3)) - 1;
+}
+
+//records one call of op which started at start and returned res
+void op_done(int op, struct timespec* start, int res, uint64_t bytes) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t ns = (uint64_t) (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+
+    struct mkfs_op_stats* st = &stats.ops[op];
+    count_event(&st->calls, 1);
+    if (res < 0) count_event(&st->errors, 1);
+    if (bytes > 0) count_event(&st->bytes, bytes);
+    count_event(&st->total_ns, ns);
+    count_event(&st->hist[stats_bucket(ns)], 1);
+    uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+//the latency in ns below which the fraction q of the calls in hist fall
+static uint64_t percentile(uint64_t* hist, uint64_t calls, double q, uint64_t max) {
+    uint64_t target = (uint64_t) (q * calls);
+    if (target < 1) target = 1;
+    uint64_t seen = 0;
+    int b;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= target) break;
+    }
+    uint64_t top = bucket_top(b);
+    return top < max ? top : max;
+}
+
+//writes the statistics as text into buf, one "name key=value ..." line per callback and one line of counters
+size_t render_stats(char* buf, size_t size) {
+    size_t len = 0;
+    int op, b;
+    for (op = 0; op < OP_COUNT && len < size; op++) {
+        struct mkfs_op_stats* st = &stats.ops[op];
+        uint64_t hist[STATS_BUCKETS];
+        uint64_t calls = 0;
+        for (b = 0; b < STATS_BUCKETS; b++) {
+            hist[b] = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED);
+            calls += hist[b];
+        }
+        uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&st->total_ns, __ATOMIC_RELAXED);
+        len += snprintf(buf + len, size - len, "%s calls=%llu errors=%llu bytes=%llu avg_us=%.1f p50_us=%.1f p90_us=%.1f "
+                "p99_us=%.1f p999_us=%.1f max_us=%.1f\n", op_names[op], (unsigned long long) calls,
+                (unsigned long long) __atomic_load_n(&st->errors, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&st->bytes, __ATOMIC_RELAXED),
+                calls > 0 ? total / 1000.0 / calls : 0.0,
+                calls > 0 ? percentile(hist, calls, 0.5, max) / 1000.0 : 0.0,
+                calls > 0 ? percentile(hist, calls, 0.9, max) / 1000.0 : 0.0,
+                calls > 0 ? percentile(hist, calls, 0.99, max) / 1000.0 : 0.0,
+                calls > 0 ? percentile(hist, calls, 0.999, max) / 1000.0 : 0.0,
+                max / 1000.0);
+    }
+
+    uint64_t hits = 0, misses = 0, read_ahead = 0;
+    pthread_mutex_lock(&cache.lock);
+    hits = cache.hits;
+    misses = cache.misses;
+    read_ahead = cache.read_ahead;
+    pthread_mutex_unlock(&cache.lock);
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "events bitmap_scans=%llu blocks_scanned=%llu allocations=%llu "
+                "blocks_allocated=%llu relocations=%llu defrag_files=%llu defrag_blocks=%llu cache_hits=%llu cache_misses=%llu "
+                "read_ahead=%llu direct_rmw=%llu ring_ios=%llu ring_enters=%llu ring_depth=%llu\n",
+                (unsigned long long) __atomic_load_n(&stats.bitmap_scans, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.blocks_scanned, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.allocations, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.blocks_allocated, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.relocations, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.defrag_files, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.defrag_blocks, __ATOMIC_RELAXED),
+                (unsigned long long) hits, (unsigned long long) misses, (unsigned long long) read_ahead,
+                (unsigned long long) __atomic_load_n(&stats.direct_rmw, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.ring_ios, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.ring_enters, __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&stats.ring_depth, __ATOMIC_RELAXED));
+    }
+    return len < size ? len : size - 1;
+}
+
+//logs the statistics, one line per callback. a line which does not fit in a log message is cut between its
+//key=value pairs into several, each starting with the name again
+void dump_stats() {
+    char* text = malloc(STATS_TEXT);
+    render_stats(text, STATS_TEXT);
+    char* save;
+    char* line = strtok_r(text, "\n", &save);
+    while (line != NULL) {
+        size_t name_len = strcspn(line, " ");
+        char* rest = line + name_len; //the pairs, each after a space
+        size_t room = LOG_LINE - 1 - strlen("STATS: ") - name_len;
+        do {
+            size_t take = strlen(rest);
+            if (take > room) {
+                take = room;
+                while (take > 0 && rest[take] != ' ') take--;
+                if (take == 0) take = room; //one pair is longer than a message
+            }
+            log_info("STATS: %.*s%.*s", (int) name_len, line, (int) take, rest);
+            rest += take;
+        } while (*rest != 0);
+        line = strtok_r(NULL, "\n", &save);
+    }
+    free(text);
+}
+//Statistics----------------------------------------------------------------------------------------------end->
+
+//I/O ring----------------------------------------------------------------------------------------------start->
+//With the uring mount option every transfer on .disk goes through one io_uring. Callers queue entries under
+//ring.lock and the first of them which finds nobody submitting enters the kernel for everything queued meanwhile,
+//so concurrent FUSE requests, readahead and the in place writes of a commit share io_uring_enter calls and keep
+//several transfers in flight. One reaper thread takes the completions and wakes the callers.
+
+static void* ring_main(void* arg);
+
+static void unmap_ring() {
+    if (ring.cq_map != NULL && ring.cq_map != MAP_FAILED && ring.cq_map != ring.sq_map) munmap(ring.cq_map, ring.cq_map_size);
+    if (ring.sq_map != NULL && ring.sq_map != MAP_FAILED) munmap(ring.sq_map, ring.sq_map_size);
+    if (ring.sqes != NULL && (void*) ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_size);
+    ring.sq_map = ring.cq_map = NULL;
+    ring.sqes = NULL;
+}
+
+//sets up the ring for the nfds members of the volume: maps it, registers them and, for O_DIRECT, the bounce buffers,
+//and starts the reaper. returns -errno and leaves the engine off if the kernel does not have or allow io_uring
+int open_ring(const int* fds, int nfds) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (rfd == -1) return -errno;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) { //came with IORING_OP_READ and IORING_OP_WRITE
+        close(rfd);
+        return -ENOSYS;
+    }
+
+    ring.sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_map_size > ring.sq_map_size) ring.sq_map_size = ring.cq_map_size;
+        ring.cq_map_size = ring.sq_map_size;
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sq_map = mmap(NULL, ring.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    ring.cq_map = ring.sq_map;
+    if (ring.sq_map != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring.cq_map = mmap(NULL, ring.cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    }
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+    //fixed files save the kernel looking up the descriptor on every transfer
+    if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED || (void*) ring.sqes == MAP_FAILED
+            || syscall(__NR_io_uring_register, rfd, IORING_REGISTER_FILES, fds, nfds) == -1) {
+        int err = errno;
+        unmap_ring();
+        close(rfd);
+        return -err;
+    }
+    char* sq = ring.sq_map;
+    char* cq = ring.cq_map;
+    ring.sq_head = (unsigned*) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*) (sq + p.sq_off.array);
+    ring.cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    unsigned i;
+    for (i = 0; i < p.sq_entries; i++) {
+        ring.sq_array[i] = i; //slot i of the ring always holds entry i
+    }
+
+    //the bounce buffers of O_DIRECT are pinned once instead of on every transfer
+    ring.fixed_buffers = 0;
+    if (image.direct && posix_memalign((void**) &bounce.region, DIRECT_ALIGN, (size_t) DIRECT_POOL * DIRECT_CHUNK) == 0) {
+        struct iovec iov[DIRECT_POOL];
+        pthread_mutex_lock(&bounce.lock);
+        for (i = 0; i < DIRECT_POOL; i++) {
+            iov[i].iov_base = bounce.region + (size_t) i * DIRECT_CHUNK;
+            iov[i].iov_len = DIRECT_CHUNK;
+            bounce.buffers[i] = iov[i].iov_base;
+        }
+        bounce.nbuffers = DIRECT_POOL;
+        pthread_mutex_unlock(&bounce.lock);
+        ring.fixed_buffers = syscall(__NR_io_uring_register, rfd, IORING_REGISTER_BUFFERS, iov, DIRECT_POOL) == 0;
+        if (!ring.fixed_buffers) log_debug("RING: bounce buffers are not registered: %s", strerror(errno));
+    }
+
+    ring.fd = rfd;
+    ring.queued = ring.inflight = ring.submitting = ring.stop = 0;
+    pthread_create(&ring.reaper, NULL, ring_main, NULL);
+    return 0;
+}
+
+//writes the entry of io (a no-op for NULL) at the tail of the submission ring. the caller holds ring.lock and made
+//room for it
+static void ring_queue(struct mkfs_io* io) {
+    unsigned tail = *ring.sq_tail;
+    struct io_uring_sqe* sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    if (io == NULL) {
+        sqe->opcode = IORING_OP_NOP;
+    } else if (io->sync) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = io->member;
+    } else {
+        int fixed = ring.fixed_buffers && io->buf >= bounce.region
+                && io->buf < bounce.region + (size_t) DIRECT_POOL * DIRECT_CHUNK;
+        if (fixed) {
+            sqe->opcode = io->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = (io->buf - bounce.region) / DIRECT_CHUNK;
+        } else {
+            sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = io->member; //the members are registered in order
+        sqe->addr = (uintptr_t) io->buf;
+        sqe->len = io->size;
+        sqe->off = io->offset;
+    }
+    sqe->user_data = (uintptr_t) io;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    ring.inflight++;
+    if (ring.inflight > __atomic_load_n(&stats.ring_depth, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&stats.ring_depth, ring.inflight, __ATOMIC_RELAXED);
+    }
+}
+
+//finishes one entry, the caller holds ring.lock and wakes the waiters
+static void ring_complete(struct mkfs_io* io, int res) {
+    ring.inflight--;
+    if (io == NULL) return;
+    io->res = res;
+    (*io->pending)--;
+}
+
+//submits what is queued unless another thread is already at it, that one submits it too. if the kernel refuses
+//the entries they fail with its error. the caller holds ring.lock
+static void ring_flush() {
+    if (ring.submitting) return;
+    ring.submitting = 1;
+    while (ring.queued > 0) {
+        int n = ring.queued;
+        pthread_mutex_unlock(&ring.lock);
+        int res = syscall(__NR_io_uring_enter, ring.fd, n, 0, 0, NULL, 0);
+        int err = errno;
+        pthread_mutex_lock(&ring.lock);
+        if (res > 0) {
+            ring.queued -= res;
+            __atomic_add_fetch(&stats.ring_enters, 1, __ATOMIC_RELAXED);
+        } else if (res == -1 && err != EINTR && err != EAGAIN && err != EBUSY) {
+            log_error("RING: Cannot submit %d transfers: %s", n, strerror(err));
+            unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+            unsigned tail;
+            for (tail = head; tail != *ring.sq_tail; tail++) {
+                ring_complete((struct mkfs_io*) (uintptr_t) ring.sqes[tail & *ring.sq_mask].user_data, -err);
+            }
+            __atomic_store_n(ring.sq_tail, head, __ATOMIC_RELEASE);
+            ring.queued = 0;
+            pthread_cond_broadcast(&ring.done);
+            pthread_cond_broadcast(&ring.space);
+        }
+    }
+    ring.submitting = 0;
+}
+
+//does n transfers through the ring and waits for all of them, each io gets res
+static void ring_rw(struct mkfs_io* ios, int n) {
+    int pending = n;
+    int i;
+    pthread_mutex_lock(&ring.lock);
+    for (i = 0; i < n; i++) {
+        while (ring.inflight >= RING_ENTRIES) {
+            ring_flush(); //what is queued has to be in flight before completions can make room
+            if (ring.inflight >= RING_ENTRIES) pthread_cond_wait(&ring.space, &ring.lock);
+        }
+        ios[i].pending = &pending;
+        ring_queue(&ios[i]);
+    }
+    __atomic_add_fetch(&stats.ring_ios, n, __ATOMIC_RELAXED);
+    ring_flush();
+    while (pending > 0) {
+        pthread_cond_wait(&ring.done, &ring.lock);
+    }
+    pthread_mutex_unlock(&ring.lock);
+}
+
+//takes completions off the ring and wakes the callers, until the ring is closed and nothing is in flight
+static void* ring_main(void* arg) {
+    pthread_mutex_lock(&ring.lock);
+    while (!ring.stop || ring.inflight > 0) {
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            pthread_mutex_unlock(&ring.lock);
+            syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            pthread_mutex_lock(&ring.lock);
+            continue;
+        }
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            ring_complete((struct mkfs_io*) (uintptr_t) cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ring.done);
+        pthread_cond_broadcast(&ring.space);
+    }
+    pthread_mutex_unlock(&ring.lock);
+    return NULL;
+}
+
+//waits for the reaper, which a no-op wakes, and tears the ring down
+void close_ring() {
+    if (ring.fd == -1) return;
+    pthread_mutex_lock(&ring.lock);
+    ring.stop = 1;
+    while (ring.inflight >= RING_ENTRIES) {
+        pthread_cond_wait(&ring.space, &ring.lock);
+    }
+    ring_queue(NULL);
+    ring_flush();
+    pthread_mutex_unlock(&ring.lock);
+    pthread_join(ring.reaper, NULL);
+    unmap_ring();
+    close(ring.fd);
+    ring.fd = -1;
+    ring.fixed_buffers = 0;
+}
+//I/O ring------------------------------------------------------------------------------------------------end->
+
+//Backing image-----------------------------------------------------------------------------------------start->
+//reads the superblock straight from .disk, which always holds block 0, to learn whether there are more members.
+//sb is zeroed if there is none
+static void read_geometry(struct mkfs_superblock* sb) {
+    void* buf;
+    memset(sb, 0, sizeof(*sb));
+    if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_ALIGN) != 0) return;
+    if (pread(image.fd, buf, DIRECT_ALIGN, 0) >= (ssize_t) sizeof(*sb)) memcpy(sb, buf, sizeof(*sb));
+    free(buf);
+}
+
+//opens .disk once and maps all of it, reads are served from the mapping and writes go through pwrite. with the
+//odirect mount option it is opened with O_DIRECT instead and not mapped, unless its file system refuses that. with
+//the uring option it is not mapped either and all of its I/O goes through the ring, if the kernel allows one.
+//a volume striped over several files opens .disk.1 on as well and always uses the ring when it can, so that the
+//pieces of one transfer go to its members at the same time
+int open_image() {
+    image.direct = 0;
+    if (options.direct) {
+        image.fd = open(".disk", O_RDWR | O_CREAT | O_DIRECT, 0664);
+        if (image.fd != -1) {
+            int i;
+            for (i = 0; i < DIRECT_LOCKS; i++) {
+                pthread_mutex_init(&image.rmw_locks[i], NULL);
+            }
+            image.direct = 1;
+        } else if (errno != EINVAL) {
+            return -errno;
+        } else {
+            log_warn("IMAGE: O_DIRECT is not supported here, .disk is cached by the host");
+        }
+    }
+    if (!image.direct) image.fd = open(".disk", O_RDWR | O_CREAT, 0664);
+    if (image.fd == -1) return -errno;
+
+    struct mkfs_superblock sb;
+    read_geometry(&sb);
+    image.nmembers = 1;
+    image.stripe_unit = 0;
+    image.stripe_blocks = 0;
+    if (sb.magic == SUPER_MAGIC && sb.version == SUPER_VERSION_STRIPED && sb.nmembers > 1 && sb.nmembers <= MAX_MEMBERS) {
+        image.nmembers = sb.nmembers;
+        image.stripe_blocks = sb.stripe_blocks;
+        image.stripe_unit = (off_t) sb.stripe_blocks * sb.block_size;
+    }
+    image.fds = malloc(image.nmembers * sizeof(int));
+    image.fds[0] = image.fd;
+    int i;
+    for (i = 1; i < image.nmembers; i++) {
+        char name[32];
+        sprintf(name, ".disk.%d", i);
+        image.fds[i] = open(name, O_RDWR | (image.direct ? O_DIRECT : 0));
+        if (image.fds[i] == -1) {
+            int err = errno;
+            log_error("IMAGE: Cannot open member %s of the volume: %s", name, strerror(err));
+            while (--i >= 0) {
+                close(image.fds[i]);
+            }
+            free(image.fds);
+            image.fds = NULL;
+            image.fd = -1;
+            return -err;
+        }
+    }
+    image.spliceable = image.nmembers == 1 && !image.direct;
+
+    if (options.uring || image.nmembers > 1) {
+        int res = open_ring(image.fds, image.nmembers);
+        if (res != 0 && image.nmembers > 1) {
+            log_warn("IMAGE: io_uring is not available (%s), the %d members are read and written one after another",
+                    strerror(-res), image.nmembers);
+        } else if (res != 0) {
+            log_warn("IMAGE: io_uring is not available (%s), .disk is read and written synchronously", strerror(-res));
+        }
+    }
+
+    struct stat st;
+    fstat(image.fd, &st);
+    image.size = st.st_size * image.nmembers; //the members are all as long as .disk
+    image.map = NULL;
+    if (image.size > 0 && image.spliceable && ring.fd == -1) {
+        image.map = mmap(NULL, image.size, PROT_READ, MAP_SHARED, image.fd, 0);
+        if (image.map == MAP_FAILED) image.map = NULL; //reads fall back to pread
+    }
+    return 0;
+}
+
+//grows the mapping after a write went past the end of the image
+static void remap_image() {
+    struct stat st;
+    pthread_rwlock_wrlock(&image.lock);
+    fstat(image.fd, &st);
+    if (st.st_size * image.nmembers > image.size) {
+        char* map;
+        if (!image.spliceable || ring.fd != -1) {
+            map = NULL;
+        } else if (image.map == NULL) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, image.fd, 0);
+        } else {
+            map = mremap(image.map, image.size, st.st_size, MREMAP_MAYMOVE);
+        }
+        image.map = map == MAP_FAILED ? NULL : map;
+        image.size = st.st_size * image.nmembers;
+    }
+    pthread_rwlock_unlock(&image.lock);
+}
+
+//takes a bounce buffer from the pool or allocates one, NULL if there is no memory
+static char* get_bounce() {
+    void* buf = NULL;
+    pthread_mutex_lock(&bounce.lock);
+    if (bounce.nbuffers > 0) buf = bounce.buffers[--bounce.nbuffers];
+    pthread_mutex_unlock(&bounce.lock);
+    if (buf == NULL && posix_memalign(&buf, DIRECT_ALIGN, DIRECT_CHUNK) != 0) buf = NULL;
+    return buf;
+}
+
+//gives a bounce buffer back. only the registered ones are kept when there are registered ones
+static void put_bounce(char* buf) {
+    pthread_mutex_lock(&bounce.lock);
+    int registered = buf >= bounce.region && buf < bounce.region + (size_t) DIRECT_POOL * DIRECT_CHUNK;
+    if (registered || (bounce.region == NULL && bounce.nbuffers < DIRECT_POOL)) {
+        bounce.buffers[bounce.nbuffers++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&bounce.lock);
+    free(buf);
+}
+
+static void release_bounce() {
+    pthread_mutex_lock(&bounce.lock);
+    if (bounce.region != NULL) {
+        free(bounce.region);
+        bounce.region = NULL;
+        bounce.nbuffers = 0;
+    }
+    while (bounce.nbuffers > 0) {
+        free(bounce.buffers[--bounce.nbuffers]);
+    }
+    pthread_mutex_unlock(&bounce.lock);
+}
+
+//finds where byte offset of the volume lives: returns the member and stores the offset in it in member_offset.
+//len is cut so that the range stays in one stripe unit
+static int stripe_locate(off_t offset, off_t* member_offset, size_t* len) {
+    if (image.nmembers == 1) {
+        *member_offset = offset;
+        return 0;
+    }
+    off_t unit = offset / image.stripe_unit;
+    off_t within = offset % image.stripe_unit;
+    if (*len > (size_t) (image.stripe_unit - within)) *len = image.stripe_unit - within;
+    *member_offset = unit / image.nmembers * image.stripe_unit + within;
+    return unit % image.nmembers;
+}
+
+//one pread or pwrite of the volume without the ring, a stripe unit at a time. returns how many bytes were moved,
+//or -1 if none were and there was an error
+static ssize_t volume_prw(char* buf, size_t size, off_t offset, int write) {
+    if (image.nmembers == 1) return write ? pwrite(image.fd, buf, size, offset) : pread(image.fd, buf, size, offset);
+    size_t done = 0;
+    while (done < size) {
+        off_t pos;
+        size_t len = size - done;
+        int member = stripe_locate(offset + done, &pos, &len);
+        ssize_t moved = write ? pwrite(image.fds[member], buf + done, len, pos) : pread(image.fds[member], buf + done, len, pos);
+        if (moved <= 0) return done > 0 ? (ssize_t) done : moved;
+        done += moved;
+        if ((size_t) moved < len) break;
+    }
+    return done;
+}
+
+//does n transfers of the volume through the ring. each is cut at stripe units and all the pieces go out together,
+//so the members work on them at the same time. each io gets the bytes moved up to its first short piece
+static void stripe_rw(struct mkfs_io* ios, int n) {
+    int i;
+    if (image.nmembers == 1) {
+        for (i = 0; i < n; i++) {
+            ios[i].member = 0;
+        }
+        ring_rw(ios, n);
+        return;
+    }
+
+    int count = 0;
+    for (i = 0; i < n; i++) {
+        off_t first = ios[i].offset / image.stripe_unit;
+        off_t last = (ios[i].offset + (off_t) ios[i].size - 1) / image.stripe_unit;
+        count += ios[i].size > 0 ? last - first + 1 : 0;
+    }
+    struct mkfs_io* pieces = malloc((count > 0 ? count : 1) * sizeof(struct mkfs_io));
+    int k = 0;
+    for (i = 0; i < n; i++) {
+        size_t done = 0;
+        while (done < ios[i].size) {
+            struct mkfs_io* piece = &pieces[k++];
+            memset(piece, 0, sizeof(*piece));
+            piece->size = ios[i].size - done;
+            piece->member = stripe_locate(ios[i].offset + done, &piece->offset, &piece->size);
+            piece->buf = ios[i].buf + done;
+            piece->write = ios[i].write;
+            done += piece->size;
+        }
+    }
+    ring_rw(pieces, count);
+
+    k = 0;
+    for (i = 0; i < n; i++) {
+        size_t done = 0;
+        int cut = 0;
+        ios[i].res = 0;
+        while (done < ios[i].size) {
+            struct mkfs_io* piece = &pieces[k++];
+            if (!cut && piece->res < 0 && ios[i].res == 0) ios[i].res = piece->res;
+            if (!cut && piece->res > 0) ios[i].res += piece->res;
+            if (piece->res < (ssize_t) piece->size) cut = 1;
+            done += piece->size;
+        }
+    }
+    free(pieces);
+}
+
+//fdatasyncs every member, all at once through the ring when it runs. returns -1 with errno set if one failed
+int sync_image() {
+    int i;
+    int err = 0;
+    if (ring.fd != -1 && image.nmembers > 1) {
+        struct mkfs_io ios[MAX_MEMBERS];
+        memset(ios, 0, image.nmembers * sizeof(struct mkfs_io));
+        for (i = 0; i < image.nmembers; i++) {
+            ios[i].sync = 1;
+            ios[i].member = i;
+        }
+        ring_rw(ios, image.nmembers);
+        for (i = 0; i < image.nmembers; i++) {
+            if (ios[i].res < 0) err = -ios[i].res;
+        }
+    } else {
+        for (i = 0; i < image.nmembers; i++) {
+            if (fdatasync(image.fds[i]) == -1) err = errno;
+        }
+    }
+    if (err == 0) return 0;
+    errno = err;
+    return -1;
+}
+
+//one pread or pwrite of the volume, through the ring when it runs
+static ssize_t disk_io(char* buf, size_t size, off_t offset, int write) {
+    if (ring.fd == -1) return volume_prw(buf, size, offset, write);
+    struct mkfs_io io = { .buf = buf, .size = size, .offset = offset, .write = write };
+    stripe_rw(&io, 1);
+    if (io.res < 0) {
+        errno = -io.res;
+        return -1;
+    }
+    return io.res;
+}
+
+//reads the aligned sector at offset into buf, zeros where it lies past the end of the image
+static void read_sector(char* buf, off_t offset) {
+    ssize_t got = disk_io(buf, DIRECT_ALIGN, offset, 0);
+    if (got < 0) got = 0;
+    memset(buf + got, 0, DIRECT_ALIGN - got);
+    __atomic_add_fetch(&stats.direct_rmw, 1, __ATOMIC_RELAXED);
+}
+
+//moves size bytes at offset of the O_DIRECT image through bounce buffers, widened to whole sectors. a write reads
+//back the first and last sector when it only covers part of them, under their rmw locks so that two writers of
+//blocks which share a sector do not undo each other. returns how many bytes were moved
+static ssize_t direct_io(char* buf, size_t size, off_t offset, int write) {
+    char* bb = get_bounce();
+    if (bb == NULL) return -1;
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        off_t start = pos & ~((off_t) DIRECT_ALIGN - 1);
+        size_t head = pos - start;
+        size_t len = DIRECT_CHUNK - head < size - done ? DIRECT_CHUNK - head : size - done;
+        size_t span = (head + len + DIRECT_ALIGN - 1) & ~((size_t) DIRECT_ALIGN - 1);
+        if (!write) {
+            ssize_t got = disk_io(bb, span, start, 0);
+            if (got <= (ssize_t) head) break;
+            int short_read = (size_t) got - head < len; //the end of the image
+            if (short_read) len = got - head;
+            memcpy(buf + done, bb + head, len);
+            done += len;
+            if (short_read) break;
+            continue;
+        }
+
+        //the locks of the partly written sectors, taken in index order
+        int partial_head = head != 0;
+        int partial_tail = (head + len) % DIRECT_ALIGN != 0;
+        int lo = partial_head ? (start / DIRECT_ALIGN) % DIRECT_LOCKS : -1;
+        int hi = partial_tail ? ((start + span) / DIRECT_ALIGN - 1) % DIRECT_LOCKS : -1;
+        if (lo == hi) hi = -1;
+        if (lo > hi) {
+            int t = lo;
+            lo = hi;
+            hi = t;
+        }
+        if (lo != -1) pthread_mutex_lock(&image.rmw_locks[lo]);
+        if (hi != -1) pthread_mutex_lock(&image.rmw_locks[hi]);
+        if (partial_head) read_sector(bb, start);
+        if (partial_tail && (span > DIRECT_ALIGN || !partial_head)) read_sector(bb + span - DIRECT_ALIGN, start + span - DIRECT_ALIGN);
+        memcpy(bb + head, buf + done, len);
+        size_t moved = 0;
+        while (moved < span) {
+            ssize_t n = disk_io(bb + moved, span - moved, start + moved, 1);
+            if (n <= 0) break;
+            moved += n;
+        }
+        if (hi != -1) pthread_mutex_unlock(&image.rmw_locks[hi]);
+        if (lo != -1) pthread_mutex_unlock(&image.rmw_locks[lo]);
+        if (moved < span) {
+            if (moved > head) done += moved - head < len ? moved - head : len;
+            break;
+        }
+        done += len;
+    }
+    put_bounce(bb);
+    return done;
+}
+
+//does n transfers on the image, all at once through the ring when it runs and one after the other otherwise.
+//each io gets res, how many bytes it moved, and the cache is updated for the writes
+void image_rw(struct mkfs_io* ios, int n) {
+    int i;
+    if (ring.fd == -1 || image.direct) { //O_DIRECT goes through the bounce buffers a piece at a time
+        for (i = 0; i < n; i++) {
+            ios[i].res = ios[i].write ? image_write(ios[i].buf, ios[i].size, ios[i].offset)
+                    : image_read(ios[i].buf, ios[i].size, ios[i].offset);
+        }
+        return;
+    }
+
+    stripe_rw(ios, n);
+    off_t end = 0;
+    for (i = 0; i < n; i++) {
+        struct mkfs_io* io = &ios[i];
+        if (!io->write) continue;
+        size_t done = io->res > 0 ? io->res : 0;
+        while (done < io->size) { //finish a short write the plain way
+            ssize_t moved = volume_prw(io->buf + done, io->size - done, io->offset + done, 1);
+            if (moved <= 0) break;
+            done += moved;
+        }
+        io->res = done;
+        if (io->offset + (off_t) done > end) end = io->offset + done;
+        cache_write(io->buf, done, io->offset);
+    }
+    if (end > __atomic_load_n(&image.size, __ATOMIC_ACQUIRE)) {
+        remap_image();
+    }
+}
+
+//reads size bytes at offset of the image, returns how many were read
+ssize_t image_read(void* buf, size_t size, off_t offset) {
+    if (image.direct) return direct_io(buf, size, offset, 0);
+    if (ring.fd != -1) {
+        struct mkfs_io io = { .buf = buf, .size = size, .offset = offset };
+        stripe_rw(&io, 1);
+        return io.res < 0 ? -1 : io.res;
+    }
+    ssize_t res;
+    pthread_rwlock_rdlock(&image.lock);
+    if (image.map != NULL && offset + size <= image.size) {
+        memcpy(buf, image.map + offset, size);
+        res = size;
+    } else {
+        res = volume_prw(buf, size, offset, 0);
+    }
+    pthread_rwlock_unlock(&image.lock);
+    return res;
+}
+
+//writes size bytes at offset of the image, returns how many were written
+ssize_t image_write(const void* buf, size_t size, off_t offset) {
+    if (ring.fd != -1 && !image.direct) {
+        struct mkfs_io io = { .buf = (char*) buf, .size = size, .offset = offset, .write = 1 };
+        image_rw(&io, 1);
+        return io.res;
+    }
+    size_t done = 0;
+    if (image.direct) {
+        ssize_t moved = direct_io((char*) buf, size, offset, 1);
+        if (moved > 0) done = moved;
+    }
+    while (!image.direct && done < size) {
+        ssize_t moved = volume_prw((char*) buf + done, size - done, offset + done, 1);
+        if (moved <= 0) break;
+        done += moved;
+    }
+    if (offset + done > __atomic_load_n(&image.size, __ATOMIC_ACQUIRE)) {
+        remap_image();
+    }
+    cache_write(buf, done, offset);
+    return done;
+}
+
+void close_image() {
+    if (image.map != NULL) munmap(image.map, image.size);
+    close_ring();
+    int i;
+    for (i = 0; i < image.nmembers; i++) {
+        close(image.fds[i]);
+    }
+    free(image.fds);
+    if (image.direct) {
+        for (i = 0; i < DIRECT_LOCKS; i++) {
+            pthread_mutex_destroy(&image.rmw_locks[i]);
+        }
+        release_bounce();
+    }
+    image.map = NULL;
+    image.fd = -1;
+    image.fds = NULL;
+    image.nmembers = 1;
+    image.stripe_unit = 0;
+    image.stripe_blocks = 0;
+    image.size = 0;
+    image.direct = 0;
+}
+//Backing image-------------------------------------------------------------------------------------------end->
+//Block cache-------------------------------------------------------------------------------------------start->
+static void *readahead_main(void* arg);
+
+//sets up a cache of cache_kb KiB and starts the readahead thread
+void init_cache(int cache_kb) {
+    cache.nslots = cache_kb > 0 ? (int) ((off_t) cache_kb * 1024 / block_size) : 0;
+    cache.hits = cache.misses = cache.read_ahead = 0;
+    cache.hand = 0;
+    cache.qhead = cache.qlen = 0;
+    cache.stop = 0;
+    if (cache.nslots == 0) return;
+
+    cache.data = malloc((size_t) cache.nslots * block_size);
+    cache.slots = malloc(cache.nslots * sizeof(struct mkfs_cache_slot));
+    int i;
+    for (i = 0; i < cache.nslots; i++) {
+        cache.slots[i].state = SLOT_EMPTY;
+        cache.slots[i].referenced = 0;
+    }
+    cache.nbuckets = 1;
+    while (cache.nbuckets < cache.nslots) cache.nbuckets *= 2;
+    cache.buckets = malloc(cache.nbuckets * sizeof(int));
+    for (i = 0; i < cache.nbuckets; i++) cache.buckets[i] = -1;
+
+    pthread_create(&cache.thread, NULL, readahead_main, NULL);
+}
+
+static int cache_bucket(int block) {
+    return ((unsigned) block * 2654435761u) & (cache.nbuckets - 1);
+}
+
+//slot which holds block, -1 if it is not cached. the caller holds cache.lock
+static int cache_find(int block) {
+    int i;
+    for (i = cache.buckets[cache_bucket(block)]; i != -1; i = cache.slots[i].next) {
+        if (cache.slots[i].block == block) return i;
+    }
+    return -1;
+}
+
+//empties a slot. the caller holds cache.lock
+static void cache_drop(int slot) {
+    int* link = &cache.buckets[cache_bucket(cache.slots[slot].block)];
+    while (*link != slot) link = &cache.slots[*link].next;
+    *link = cache.slots[slot].next;
+    cache.slots[slot].state = SLOT_EMPTY;
+}
+
+//takes a slot for block with CLOCK: slots which were used since the hand last passed get another round.
+//returns -1 if every slot is being read ahead. the caller holds cache.lock
+static int cache_take(int block, int state, int referenced) {
+    int tries;
+    for (tries = 0; tries < 2 * cache.nslots; tries++) {
+        int i = cache.hand;
+        struct mkfs_cache_slot* slot = &cache.slots[i];
+        cache.hand = (cache.hand + 1) % cache.nslots;
+        if (slot->state == SLOT_LOADING || slot->state == SLOT_STALE) continue;
+        if (slot->state == SLOT_VALID) {
+            if (slot->referenced) {
+                slot->referenced = 0;
+                continue;
+            }
+            cache_drop(i);
+        }
+
+        int bucket = cache_bucket(block);
+        slot->block = block;
+        slot->state = state;
+        slot->referenced = referenced;
+        slot->next = cache.buckets[bucket];
+        cache.buckets[bucket] = i;
+        return i;
+    }
+    return -1;
+}
+
+//reads size bytes at offset of the image through the cache, runs of missing blocks are read with one image_read.
+//like the readahead, a miss takes placeholders for the run before it lets go of the lock, so a write which lands
+//during the read marks them stale instead of finding nothing to update and being undone by the old data
+ssize_t cache_read(char* buf, size_t size, off_t offset) {
+    if (cache.nslots == 0) return image_read(buf, size, offset);
+
+    size_t done = 0;
+    char* run_buf = NULL;
+    int* run_slots = NULL;
+    pthread_mutex_lock(&cache.lock);
+    while (done < size) {
+        off_t pos = offset + done;
+        int block = pos / block_size;
+        int skip = pos % block_size;
+        int slot = cache_find(block);
+        if (slot != -1 && cache.slots[slot].state == SLOT_VALID) {
+            size_t len = block_size - skip;
+            if (len > size - done) len = size - done;
+            memcpy(buf + done, cache.data + (size_t) slot * block_size + skip, len);
+            cache.slots[slot].referenced = 1;
+            cache.hits++;
+            done += len;
+            continue;
+        }
+
+        //a miss, read every block up to the next cached one at once
+        int last = (offset + size - 1) / block_size;
+        int n = 1;
+        while (block + n <= last && cache_find(block + n) == -1) n++;
+        cache.misses += n;
+        run_slots = realloc(run_slots, n * sizeof(int));
+        int i;
+        for (i = 0; i < n; i++) { //the first block may be being read ahead already, that one is left alone
+            run_slots[i] = slot == -1 || i > 0 ? cache_take(block + i, SLOT_LOADING, 0) : -1;
+        }
+        pthread_mutex_unlock(&cache.lock);
+
+        run_buf = realloc(run_buf, (size_t) n * block_size);
+        ssize_t got = image_read(run_buf, (size_t) n * block_size, (off_t) block * block_size);
+        size_t len = 0;
+        if (got > skip) {
+            len = got - skip;
+            if (len > size - done) len = size - done;
+            memcpy(buf + done, run_buf + skip, len);
+        }
+
+        //keep the whole blocks which were read, unless they were written meanwhile
+        pthread_mutex_lock(&cache.lock);
+        for (i = 0; i < n; i++) {
+            if (run_slots[i] == -1) continue;
+            if (cache.slots[run_slots[i]].state == SLOT_LOADING && (ssize_t) (i + 1) * block_size <= got) {
+                memcpy(cache.data + (size_t) run_slots[i] * block_size, run_buf + (size_t) i * block_size, block_size);
+                cache.slots[run_slots[i]].state = SLOT_VALID;
+            } else {
+                cache_drop(run_slots[i]);
+            }
+        }
+        done += len;
+        if (got < (ssize_t) n * block_size) break;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    free(run_buf);
+    free(run_slots);
+    return done;
+}
+
+//updates the cached copies of blocks which were just written to the image
+void cache_write(const char* buf, size_t size, off_t offset) {
+    if (cache.nslots == 0 || size == 0) return;
+
+    pthread_mutex_lock(&cache.lock);
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        int skip = pos % block_size;
+        size_t len = block_size - skip;
+        if (len > size - done) len = size - done;
+        int slot = cache_find(pos / block_size);
+        if (slot != -1) {
+            if (cache.slots[slot].state == SLOT_VALID) {
+                memcpy(cache.data + (size_t) slot * block_size + skip, buf + done, len);
+            } else {
+                cache.slots[slot].state = SLOT_STALE; //a read in flight may have read the old data
+            }
+        }
+        done += len;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+//drops the cached copies of blocks which were written to the image behind the cache's back
+void cache_invalidate(off_t offset, size_t size) {
+    if (cache.nslots == 0 || size == 0) return;
+
+    pthread_mutex_lock(&cache.lock);
+    int block;
+    for (block = offset / block_size; block <= (offset + size - 1) / block_size; block++) {
+        int slot = cache_find(block);
+        if (slot == -1) continue;
+        if (cache.slots[slot].state == SLOT_VALID) {
+            cache_drop(slot);
+        } else {
+            cache.slots[slot].state = SLOT_STALE;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+//asks the readahead thread to bring a run of disk blocks into the cache, dropped if the queue is full
+void cache_readahead(int start_block, int num_blocks) {
+    if (cache.nslots == 0 || num_blocks <= 0) return;
+    if (num_blocks > cache.nslots / 4) num_blocks = cache.nslots / 4; //leave room for everything else
+
+    pthread_mutex_lock(&cache.lock);
+    if (cache.qlen < READAHEAD_QUEUE) {
+        struct mkfs_extent* run = &cache.queue[(cache.qhead + cache.qlen) % READAHEAD_QUEUE];
+        run->nStartBlock = start_block;
+        run->nBlocks = num_blocks;
+        cache.qlen++;
+        pthread_cond_signal(&cache.wake);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+//reads queued runs, all at once through the ring when it runs: placeholders are taken first so writes that race
+//with the reads mark them stale
+static void read_ahead(struct mkfs_extent* runs, int nruns) {
+    int* slots[RING_BATCH];
+    struct mkfs_io ios[RING_BATCH];
+    int n = 0;
+    int r, i;
+    for (r = 0; r < nruns; r++) {
+        int* run_slots = malloc(runs[r].nBlocks * sizeof(int));
+        int taken = 0;
+        pthread_mutex_lock(&cache.lock);
+        for (i = 0; i < runs[r].nBlocks; i++) {
+            run_slots[i] = -1;
+            if (cache_find(runs[r].nStartBlock + i) != -1) continue;
+            run_slots[i] = cache_take(runs[r].nStartBlock + i, SLOT_LOADING, 0);
+            if (run_slots[i] == -1) break;
+            taken++;
+        }
+        pthread_mutex_unlock(&cache.lock);
+        if (taken == 0) {
+            free(run_slots);
+            continue;
+        }
+        slots[n] = run_slots;
+        ios[n] = (struct mkfs_io) { .size = (size_t) i * block_size, .offset = (off_t) runs[r].nStartBlock * block_size };
+        ios[n].buf = malloc(ios[n].size);
+        n++;
+    }
+    image_rw(ios, n);
+
+    pthread_mutex_lock(&cache.lock);
+    for (r = 0; r < n; r++) {
+        for (i = 0; i < (int) (ios[r].size / block_size); i++) {
+            if (slots[r][i] == -1) continue;
+            struct mkfs_cache_slot* slot = &cache.slots[slots[r][i]];
+            if (slot->state == SLOT_LOADING && (ssize_t) (i + 1) * block_size <= ios[r].res) {
+                memcpy(cache.data + (size_t) slots[r][i] * block_size, ios[r].buf + (size_t) i * block_size, block_size);
+                slot->state = SLOT_VALID;
+                cache.read_ahead++;
+            } else {
+                cache_drop(slots[r][i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    for (r = 0; r < n; r++) {
+        free(ios[r].buf);
+        free(slots[r]);
+    }
+}
+
+//takes up to RING_BATCH queued runs at a time
+static void *readahead_main(void* arg) {
+    struct mkfs_extent runs[RING_BATCH];
+    pthread_mutex_lock(&cache.lock);
+    while (!cache.stop) {
+        if (cache.qlen == 0) {
+            pthread_cond_wait(&cache.wake, &cache.lock);
+            continue;
+        }
+        int n = 0;
+        while (cache.qlen > 0 && n < RING_BATCH) {
+            runs[n++] = cache.queue[cache.qhead];
+            cache.qhead = (cache.qhead + 1) % READAHEAD_QUEUE;
+            cache.qlen--;
+        }
+        pthread_mutex_unlock(&cache.lock);
+        read_ahead(runs, n);
+        pthread_mutex_lock(&cache.lock);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+}
+
+//stops the readahead thread and frees the cache
+void release_cache() {
+    if (cache.nslots == 0) return;
+
+    pthread_mutex_lock(&cache.lock);
+    cache.stop = 1;
+    pthread_cond_signal(&cache.wake);
+    pthread_mutex_unlock(&cache.lock);
+    pthread_join(cache.thread, NULL);
+
+    log_info("CACHE: %llu hits, %llu misses, %llu blocks read ahead",
+            (unsigned long long) cache.hits, (unsigned long long) cache.misses, (unsigned long long) cache.read_ahead);
+    free(cache.data);
+    free(cache.slots);
+    free(cache.buckets);
+    cache.data = NULL;
+    cache.slots = NULL;
+    cache.buckets = NULL;
+    cache.nslots = 0;
+}
+//Block cache---------------------------------------------------------------------------------------------end->
+
+//number of bitmap blocks needed to describe blocks_on_disk blocks
+static int bitmap_blocks_needed(off_t blocks_on_disk) {
+    int bitmap_bytes_needed = blocks_on_disk / 8 + 1;
+    return bitmap_bytes_needed / block_size + 1;
+}
+
+//return last index of block from bitmap
+int last_bitmap_index() {
+    return bitmap.nblocks - 1;
+}
+
+//returns 1 if the block is allocated, otherwise 0
+int get_state(int block_idx) {
+    pthread_mutex_lock(&bitmap.lock);
+    int result = (bitmap.words[block_idx / BITS_IN_WORD] >> (block_idx % BITS_IN_WORD)) & 1;
+    pthread_mutex_unlock(&bitmap.lock);
+    return result;
+}
+
+//calculates size (in blocks) of bitmap
+int get_bitmap_size() {
+    return bitmap.nblocks_bitmap;
+}
+
+//Superblock--------------------------------------------------------------------------------------------start->
+//creates an empty image of size bytes with blocks of bsize bytes in the current directory: the superblock and
+//bitmap go out in one write, .dir starts with only its header and .journal empty. preallocate reserves the blocks
+//of .disk up front. returns 0 or -errno
+int format_image(off_t size, int bsize, int preallocate) {
+    return format_volume(size, bsize, preallocate, NULL, 1, 0);
+}
+
+//creates an image like format_image, striped over nmembers files in units of stripe_unit bytes: .disk holds the
+//first unit and the superblock, .disk.1 the second and so on round and round. paths, if not NULL, gives for each
+//member after .disk a file elsewhere (on another disk) which is created and linked as .disk.N, the others are
+//created here. size is cut to whole stripes and each member gets an equal share of it
+int format_volume(off_t size, int bsize, int preallocate, const char** paths, int nmembers, int stripe_unit) {
+    if (bsize < MIN_BLOCK_SIZE || bsize > MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0) return -EINVAL;
+    if (nmembers < 1 || nmembers > MAX_MEMBERS) return -EINVAL;
+    if (nmembers > 1 && (stripe_unit < bsize || stripe_unit % DIRECT_ALIGN != 0 || (stripe_unit & (stripe_unit - 1)) != 0)) {
+        return -EINVAL;
+    }
+    block_size = bsize;
+    int stripe_blocks = nmembers > 1 ? stripe_unit / block_size : 0;
+    off_t nblocks = size / block_size;
+    if (nmembers > 1) nblocks -= nblocks % ((off_t) stripe_blocks * nmembers);
+    if (nblocks > INT32_MAX) return -EFBIG;
+    int nblocks_bitmap = bitmap_blocks_needed(nblocks);
+    int data_start = 1 + nblocks_bitmap;
+    if (nblocks <= data_start) return -ENOSPC;
+
+    int fds[MAX_MEMBERS];
+    int res = 0;
+    int i;
+    for (i = 0; i < nmembers; i++) {
+        fds[i] = -1;
+    }
+    for (i = 0; i < nmembers && res == 0; i++) {
+        char name[32];
+        sprintf(name, i == 0 ? ".disk" : ".disk.%d", i);
+        if (i > 0) unlink(name);
+        if (i > 0 && paths != NULL && paths[i - 1] != NULL) {
+            fds[i] = open(paths[i - 1], O_RDWR | O_CREAT | O_TRUNC, 0664);
+            if (fds[i] != -1 && symlink(paths[i - 1], name) == -1) res = -errno;
+        } else {
+            fds[i] = open(name, O_RDWR | O_CREAT | O_TRUNC, 0664);
+        }
+        if (fds[i] == -1) res = -errno;
+        off_t member_size = nblocks * block_size / nmembers;
+        if (res == 0 && ftruncate(fds[i], member_size) == -1) res = -errno;
+        if (res == 0 && preallocate) res = -posix_fallocate(fds[i], 0, member_size);
+    }
+
+    //superblock and bitmap, with the blocks they take marked allocated
+    size_t head_size = (size_t) data_start * block_size;
+    char* head = calloc(head_size, 1);
+    struct mkfs_superblock* sb = (struct mkfs_superblock*) head;
+    sb->magic = SUPER_MAGIC;
+    sb->version = nmembers > 1 ? SUPER_VERSION_STRIPED : SUPER_VERSION;
+    sb->block_size = block_size;
+    sb->nblocks = nblocks;
+    sb->bitmap_start = 1;
+    sb->nblocks_bitmap = nblocks_bitmap;
+    sb->data_start = data_start;
+    sb->free_blocks = nblocks - data_start;
+    sb->created = time(NULL);
+    sb->nmembers = nmembers;
+    sb->stripe_blocks = stripe_blocks;
+    uint64_t* words = (uint64_t*) (head + block_size);
+    for (i = 0; i < data_start; i++) {
+        words[i / BITS_IN_WORD] |= 1ULL << (i % BITS_IN_WORD);
+    }
+    //the head may cross stripe units, each goes to its member
+    off_t unit_size = nmembers > 1 ? stripe_unit : (off_t) head_size;
+    size_t done = 0;
+    while (res == 0 && done < head_size) {
+        off_t unit = done / unit_size;
+        off_t within = done % unit_size;
+        size_t len = unit_size - within < (off_t) (head_size - done) ? (size_t) (unit_size - within) : head_size - done;
+        off_t pos = unit / nmembers * unit_size + within;
+        if (pwrite(fds[unit % nmembers], head + done, len, pos) != (ssize_t) len) res = errno != 0 ? -errno : -EIO;
+        done += len;
+    }
+    for (i = 0; i < nmembers; i++) {
+        if (fds[i] == -1) continue;
+        if (res == 0 && fsync(fds[i]) == -1) res = -errno;
+        close(fds[i]);
+    }
+    free(head);
+    if (res != 0) return res;
+
+    //.dir holds only its header, .journal nothing
+    const char* empty[] = { ".dir", ".journal" };
+    for (i = 0; i < 2; i++) {
+        int fd = open(empty[i], O_RDWR | O_CREAT | O_TRUNC, 0664);
+        if (fd == -1) return -errno;
+        if (i == 0) {
+            mkfs_directory_entry header;
+            dir_header(&header);
+            if (write(fd, &header, sizeof(header)) != sizeof(header)) res = -EIO;
+        }
+        if (res == 0 && fsync(fd) == -1) res = -errno;
+        close(fd);
+    }
+    return res;
+}
+
+//reads the superblock of .disk and takes the block size from it. an image without one is left with super
+//zeroed and DEFAULT_BLOCK_SIZE. returns -EINVAL if there is a superblock which this build cannot mount
+int load_superblock() {
+    memset(&super, 0, sizeof(super));
+    block_size = DEFAULT_BLOCK_SIZE;
+    struct mkfs_superblock sb;
+    if (image_read(&sb, sizeof(sb), 0) != sizeof(sb) || sb.magic != SUPER_MAGIC) return 0;
+    if ((sb.version != SUPER_VERSION && sb.version != SUPER_VERSION_STRIPED) || sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE
+            || (sb.block_size & (sb.block_size - 1)) != 0) {
+        log_error("Superblock of version %u with %u byte blocks is not supported", sb.version, sb.block_size);
+        return -EINVAL;
+    }
+    super = sb;
+    block_size = sb.block_size;
+    return 0;
+}
+
+//logs the superblock with the current free count, the caller holds bitmap.lock
+static void flush_superblock() {
+    char* block = calloc(block_size, 1);
+    super.free_blocks = free_index.nfree;
+    memcpy(block, &super, sizeof(super));
+    meta_write(TARGET_DISK, block, block_size, 0);
+    free(block);
+}
+//Superblock----------------------------------------------------------------------------------------------end->
+
+//Free extent index-------------------------------------------------------------------------------------start->
+//Every run of free blocks is one node which sits in two treaps at the same time: one ordered by start block
+//(to find neighbours when blocks are freed) and one ordered by (length, start) (to find the best fit).
+static int extent_less(mkfs_free_extent* a, mkfs_free_extent* b, int tree) {
+    if (tree == BY_SIZE && a->len != b->len) return a->len < b->len;
+    return a->start < b->start;
+}
+
+//joins two treaps where every node of a is smaller than every node of b
+static mkfs_free_extent* treap_merge(mkfs_free_extent* a, mkfs_free_extent* b, int tree) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (a->prio > b->prio) {
+        a->child[tree][1] = treap_merge(a->child[tree][1], b, tree);
+        return a;
+    }
+    b->child[tree][0] = treap_merge(a, b->child[tree][0], tree);
+    return b;
+}
+
+//splits t into nodes smaller than key (l) and the rest (r)
+static void treap_split(mkfs_free_extent* t, mkfs_free_extent* key, int tree, mkfs_free_extent** l, mkfs_free_extent** r) {
+    if (t == NULL) {
+        *l = *r = NULL;
+    } else if (extent_less(t, key, tree)) {
+        treap_split(t->child[tree][1], key, tree, &t->child[tree][1], r);
+        *l = t;
+    } else {
+        treap_split(t->child[tree][0], key, tree, l, &t->child[tree][0]);
+        *r = t;
+    }
+}
+
+static mkfs_free_extent* treap_erase(mkfs_free_extent* t, mkfs_free_extent* x, int tree) {
+    if (t == x) return treap_merge(t->child[tree][0], t->child[tree][1], tree);
+    if (extent_less(x, t, tree)) {
+        t->child[tree][0] = treap_erase(t->child[tree][0], x, tree);
+    } else {
+        t->child[tree][1] = treap_erase(t->child[tree][1], x, tree);
+    }
+    return t;
+}
+
+static void index_insert(int start, int len) {
+    mkfs_free_extent* x = calloc(1, sizeof(*x));
+    x->start = start;
+    x->len = len;
+    x->prio = rand();
+    int tree;
+    for (tree = BY_START; tree <= BY_SIZE; tree++) {
+        mkfs_free_extent* l;
+        mkfs_free_extent* r;
+        treap_split(free_index.root[tree], x, tree, &l, &r);
+        free_index.root[tree] = treap_merge(treap_merge(l, x, tree), r, tree);
+    }
+    free_index.nfree += len;
+    free_index.nextents++;
+}
+
+static void index_erase(mkfs_free_extent* x) {
+    free_index.root[BY_START] = treap_erase(free_index.root[BY_START], x, BY_START);
+    free_index.root[BY_SIZE] = treap_erase(free_index.root[BY_SIZE], x, BY_SIZE);
+    free_index.nfree -= x->len;
+    free_index.nextents--;
+    free(x);
+}
+
+//returns the free extent with the largest start <= block, or NULL
+static mkfs_free_extent* index_floor(int block) {
+    mkfs_free_extent* t = free_index.root[BY_START];
+    mkfs_free_extent* best = NULL;
+    while (t != NULL) {
+        if (t->start <= block) {
+            best = t;
+            t = t->child[BY_START][1];
+        } else {
+            t = t->child[BY_START][0];
+        }
+    }
+    return best;
+}
+
+//returns the free extent with the smallest start > block, or NULL
+static mkfs_free_extent* index_next(int block) {
+    mkfs_free_extent* t = free_index.root[BY_START];
+    mkfs_free_extent* best = NULL;
+    while (t != NULL) {
+        if (t->start > block) {
+            best = t;
+            t = t->child[BY_START][0];
+        } else {
+            t = t->child[BY_START][1];
+        }
+    }
+    return best;
+}
+
+//returns the smallest free extent of at least num_blocks blocks, or NULL
+static mkfs_free_extent* index_best_fit(int num_blocks) {
+    mkfs_free_extent* t = free_index.root[BY_SIZE];
+    mkfs_free_extent* best = NULL;
+    while (t != NULL) {
+        if (t->len >= num_blocks) {
+            best = t;
+            t = t->child[BY_SIZE][0];
+        } else {
+            t = t->child[BY_SIZE][1];
+        }
+    }
+    return best;
+}
+
+//returns the largest free extent, or NULL if the disk is full
+static mkfs_free_extent* index_largest() {
+    mkfs_free_extent* t = free_index.root[BY_SIZE];
+    while (t != NULL && t->child[BY_SIZE][1] != NULL) {
+        t = t->child[BY_SIZE][1];
+    }
+    return t;
+}
+
+//blocks [start, end) became allocated, cut them out of the free extents
+static void index_take(int start, int end) {
+    mkfs_free_extent* x = index_floor(start);
+    if (x == NULL || x->start + x->len <= start) x = index_next(start);
+    while (x != NULL && x->start < end) {
+        int x_start = x->start;
+        int x_end = x->start + x->len;
+        index_erase(x);
+        if (x_start < start) index_insert(x_start, start - x_start);
+        if (x_end > end) {
+            index_insert(end, x_end - end);
+            break;
+        }
+        x = index_next(x_end - 1);
+    }
+}
+
+//blocks [start, end) became free, merge them with the free extents they touch
+static void index_give(int start, int end) {
+    mkfs_free_extent* x = index_floor(start);
+    if (x == NULL || x->start + x->len < start) x = index_next(start);
+    while (x != NULL && x->start <= end) {
+        int x_start = x->start;
+        int x_end = x->start + x->len;
+        index_erase(x);
+        if (x_start < start) start = x_start;
+        if (x_end > end) end = x_end;
+        x = index_next(x_end - 1);
+    }
+    index_insert(start, end - start);
+}
+
+//returns the first block >= i whose bit equals value, skipping whole words with count-trailing-zeros
+static int next_bit(int i, int value) {
+    int nwords = (bitmap.nblocks + BITS_IN_WORD - 1) / BITS_IN_WORD;
+    int w = i / BITS_IN_WORD;
+    if (w >= nwords) return bitmap.nblocks;
+    uint64_t word = value ? bitmap.words[w] : ~bitmap.words[w];
+    word &= ~0ULL << (i % BITS_IN_WORD);
+    while (word == 0) {
+        if (++w >= nwords) return bitmap.nblocks;
+        word = value ? bitmap.words[w] : ~bitmap.words[w];
+    }
+    i = w * BITS_IN_WORD + __builtin_ctzll(word);
+    return i < bitmap.nblocks ? i : bitmap.nblocks;
+}
+
+//builds the free extent index from the in-memory bitmap
+void build_free_index() {
+    count_event(&stats.bitmap_scans, 1);
+    count_event(&stats.blocks_scanned, bitmap.nblocks);
+    int i = next_bit(0, 0);
+    while (i < bitmap.nblocks) {
+        int end = next_bit(i, 1);
+        index_insert(i, end - i);
+        i = next_bit(end, 0);
+    }
+}
+
+static void release_free_tree(mkfs_free_extent* t) {
+    if (t == NULL) return;
+    release_free_tree(t->child[BY_START][0]);
+    release_free_tree(t->child[BY_START][1]);
+    free(t);
+}
+
+void release_free_index() {
+    release_free_tree(free_index.root[BY_START]);
+    memset(&free_index, 0, sizeof(free_index));
+}
+//Free extent index---------------------------------------------------------------------------------------end->
+
+//sets (sign == 1) or clears (sign == -1) num_blocks bits starting at start_block, a word at a time
+//the caller holds bitmap.lock
+static void change_range_locked(int start_block, int num_blocks, int sign) {
+    int end = start_block + num_blocks;
+    if (start_block < 0) start_block = 0;
+    if (end > bitmap.nblocks) end = bitmap.nblocks;
+    if (start_block >= end) return;
+
+    int i = start_block;
+    while (i < end) {
+        int bit_idx = i % BITS_IN_WORD;
+        int bits = BITS_IN_WORD - bit_idx;
+        if (bits > end - i) bits = end - i;
+        uint64_t operand = bits == BITS_IN_WORD ? ~0ULL : ((1ULL << bits) - 1) << bit_idx;
+        if (sign == -1) { //if we are unsetting the bits
+            bitmap.words[i / BITS_IN_WORD] &= ~operand;
+        } else { //if we are setting the bits
+            bitmap.words[i / BITS_IN_WORD] |= operand;
+        }
+        i += bits;
+    }
+
+    if (sign == -1) {
+        index_give(start_block, end);
+    } else {
+        index_take(start_block, end);
+    }
+
+    //remember which bitmap blocks have to be written back
+    int first = start_block / 8 / block_size;
+    int last = (end - 1) / 8 / block_size;
+    for (i = first; i <= last; i++) {
+        if (!bitmap.dirty[i]) {
+            bitmap.dirty[i] = 1;
+            bitmap.ndirty++;
+        }
+    }
+}
+
+void change_range(int start_block, int num_blocks, int sign) {
+    pthread_mutex_lock(&bitmap.lock);
+    change_range_locked(start_block, num_blocks, sign);
+    pthread_mutex_unlock(&bitmap.lock);
+}
+
+void change_bit(int i, int sign) {
+    change_range(i, 1, sign);
+}
+
+//wrappers for the change_bit
+void set(int i) { //set the bit to 1
+    change_bit(i, 1);
+    return;
+}
+
+void unset(int i) { //set the bit to 0
+    change_bit(i, -1);
+    return;
+}
+
+void allocate(int start_block, int num_blocks) {
+    change_range(start_block, num_blocks, 1);
+}
+
+void unallocate(int start_block, int num_blocks) {
+    log_trace("Unallocating %d starting at %d", num_blocks, start_block);
+    change_range(start_block, num_blocks, -1);
+}
+
+//logs every dirty bitmap block, coalescing neighbouring blocks into one write
+void flush_bitmap() {
+    pthread_mutex_lock(&bitmap.lock);
+    if (bitmap.ndirty > 0) {
+        int i = 0;
+        while (i < bitmap.nblocks_bitmap) {
+            if (!bitmap.dirty[i]) {
+                i++;
+                continue;
+            }
+            int run_start = i;
+            while (i < bitmap.nblocks_bitmap && bitmap.dirty[i]) {
+                bitmap.dirty[i] = 0;
+                i++;
+            }
+            meta_write(TARGET_DISK, (char*) bitmap.words + (off_t) run_start * block_size, (size_t) (i - run_start) * block_size,
+                (off_t) (bitmap.start + run_start) * block_size);
+        }
+        bitmap.ndirty = 0;
+        if (super.magic == SUPER_MAGIC) flush_superblock();
+    }
+    pthread_mutex_unlock(&bitmap.lock);
+}
+
+//reads the whole bitmap from .disk once
+void load_bitmap() {
+    if (super.magic == SUPER_MAGIC) { //the geometry comes from the formatter
+        bitmap.nblocks = super.nblocks;
+        bitmap.start = super.bitmap_start;
+        bitmap.nblocks_bitmap = super.nblocks_bitmap;
+    } else {
+        off_t bytes_on_disk = image.size;
+        bitmap.nblocks = bytes_on_disk / block_size; //keep as is to round down so you don't have a half sized block at end
+        bitmap.start = 0;
+        bitmap.nblocks_bitmap = bitmap_blocks_needed(bitmap.nblocks);
+    }
+    bitmap.words = calloc((size_t) bitmap.nblocks_bitmap * block_size / sizeof(uint64_t), sizeof(uint64_t));
+    bitmap.dirty = calloc(bitmap.nblocks_bitmap, 1);
+    bitmap.ndirty = 0;
+
+    image_read(bitmap.words, (size_t) bitmap.nblocks_bitmap * block_size, (off_t) bitmap.start * block_size);
+
+    build_free_index();
+}
+
+//writes back what is left and frees the bitmap
+void release_bitmap() {
+    flush_bitmap();
+    release_free_index();
+    free(bitmap.words);
+    free(bitmap.dirty);
+    bitmap.words = NULL;
+    bitmap.dirty = NULL;
+}
+
+//makes the bitmap if it doesnt exist, only images from before the formatter are made this way
+void check_bitmap() {
+    if (super.magic != SUPER_MAGIC && (bitmap.words[0] & 0xff) == 0) { //then the beginning of the bitmap is zero and thus the bitmap does not exist
+        int bitmap_size = get_bitmap_size();
+        log_info("Creating new bitmap of size %d", bitmap_size);
+        allocate(0, bitmap_size);
+    }
+    return;
+}
+
+//finds contiguous free blocks, taking the best fit from the free extent index
+int find_free_space(int num_blocks) {
+    pthread_mutex_lock(&bitmap.lock);
+    mkfs_free_extent* x = index_best_fit(num_blocks);
+    int result = x == NULL ? -1 : x->start;
+    pthread_mutex_unlock(&bitmap.lock);
+    return result;
+}
+
+//length of the longest free run
+int free_largest_run() {
+    pthread_mutex_lock(&bitmap.lock);
+    mkfs_free_extent* x = index_largest();
+    int len = x == NULL ? 0 : x->len;
+    pthread_mutex_unlock(&bitmap.lock);
+    return len;
+}
+
+//allocates up to num_blocks contiguous blocks: from the free run holding goal if there is one (so a file can grow
+//in place), otherwise the best fit, otherwise the largest free run. on a striped volume a run of a stripe unit or
+//more starts on a unit if a free run allows it, so that its large transfers split evenly over the members.
+//returns the first block and stores the number of blocks taken in got, or returns -1 if the disk is full
+int allocate_extent(int goal, int num_blocks, int* got) {
+    pthread_mutex_lock(&bitmap.lock);
+    int start = -1;
+    int unit = image.stripe_blocks;
+    mkfs_free_extent* x = goal >= 0 ? index_floor(goal) : NULL;
+    if (x != NULL && x->start + x->len > goal) {
+        start = goal;
+        *got = x->start + x->len - goal;
+    } else if (unit > 0 && num_blocks >= unit && (x = index_best_fit(num_blocks + unit - 1)) != NULL) {
+        start = (x->start + unit - 1) / unit * unit;
+        *got = x->start + x->len - start;
+    } else {
+        x = index_best_fit(num_blocks);
+        if (x == NULL) x = index_largest();
+        if (x != NULL) {
+            start = x->start;
+            *got = x->len;
+        }
+    }
+    int avail = free_index.nfree - free_index.reserved; //blocks promised to buffered data are off limits
+    if (start != -1 && avail <= 0) start = -1;
+    if (start != -1) {
+        if (*got > num_blocks) *got = num_blocks;
+        if (*got > avail) *got = avail;
+        change_range_locked(start, *got, 1);
+    }
+    pthread_mutex_unlock(&bitmap.lock);
+    if (start != -1) {
+        count_event(&stats.allocations, 1);
+        count_event(&stats.blocks_allocated, *got);
+    }
+    return start;
+}
+
+//promises num_blocks free blocks to buffered data so that its allocation cannot fail later.
+//returns -1 if there are not that many unpromised free blocks, unless force is set
+int reserve_blocks(int num_blocks, int force) {
+    int res = 0;
+    pthread_mutex_lock(&bitmap.lock);
+    if (!force && free_index.nfree - free_index.reserved < num_blocks) {
+        res = -1;
+    } else {
+        free_index.reserved += num_blocks;
+    }
+    pthread_mutex_unlock(&bitmap.lock);
+    return res;
+}
+
+void unreserve_blocks(int num_blocks) {
+    pthread_mutex_lock(&bitmap.lock);
+    free_index.reserved -= num_blocks;
+    pthread_mutex_unlock(&bitmap.lock);
+}
+//File extents------------------------------------------------------------------------------------------start->
+//returns the disk block an extent starting at start_block begins at, written or not
+static int disk_start(int start_block) {
+    return start_block < HOLE_BLOCK ? UNWRITTEN_BLOCK(start_block) : start_block;
+}
+
+//returns the nStartBlock of what is left of an extent starting at start_block once its first num_blocks are cut off
+static int skip_blocks(int start_block, int num_blocks) {
+    if (start_block == HOLE_BLOCK) return HOLE_BLOCK;
+    return start_block < HOLE_BLOCK ? start_block - num_blocks : start_block + num_blocks;
+}
+
+//appends a run of blocks (a hole if start_block is HOLE_BLOCK, unwritten blocks if it is UNWRITTEN_BLOCK) to the
+//map, growing the last extent when the run continues it
+static void push_extent(mkfs_extent_map* map, int start_block, int num_blocks) {
+    int n = map->nExtents;
+    if (n > 0 && skip_blocks(map->extents[n - 1].nStartBlock, map->extents[n - 1].nBlocks) == start_block) {
+        map->extents[n - 1].nBlocks += num_blocks;
+        map->ends[n - 1] += num_blocks;
+        if (map->dirty_from > n - 1) map->dirty_from = n - 1;
+        return;
+    }
+    if (n == map->capacity) {
+        map->capacity = map->capacity == 0 ? 4 : map->capacity * 2;
+        map->extents = realloc(map->extents, map->capacity * sizeof(mkfs_extent));
+        map->ends = realloc(map->ends, map->capacity * sizeof(int));
+    }
+    map->extents[n].nStartBlock = start_block;
+    map->extents[n].nBlocks = num_blocks;
+    map->ends[n] = (n > 0 ? map->ends[n - 1] : 0) + num_blocks;
+    map->nExtents++;
+    if (map->dirty_from > n) map->dirty_from = n;
+}
+
+//reads the extents of a file from its directory record and its chain of indirect extent blocks
+void load_extents(mkfs_file_directory* file, mkfs_extent_map* map) {
+    memset(map, 0, sizeof(*map));
+    if (file->nExtents < 0) return; //a small file, its data is not in blocks of its own
+    int i;
+    for (i = 0; i < file->nExtents && i < MAX_INLINE_EXTENTS; i++) {
+        push_extent(map, file->extents[i].nStartBlock, file->extents[i].nBlocks);
+    }
+
+    int block = file->nIndirectBlock;
+    mkfs_indirect_block* indirect = block != -1 ? malloc(block_size) : NULL;
+    while (block != -1) {
+        if (meta_read(indirect, block_size, (off_t) block * block_size) != block_size) break;
+
+        map->indirect = realloc(map->indirect, (map->nIndirect + 1) * sizeof(int));
+        map->indirect[map->nIndirect++] = block;
+        for (i = 0; i < indirect->nExtents && i < MAX_EXTENTS_IN_BLOCK; i++) {
+            push_extent(map, indirect->extents[i].nStartBlock, indirect->extents[i].nBlocks);
+        }
+        block = indirect->nNextBlock;
+    }
+    free(indirect);
+    map->dirty_from = map->nExtents;
+    map->nStored = map->nExtents;
+}
+
+//writes the extents back into the directory record, rewriting only the indirect blocks which changed.
+//returns -1 if there is no space left for a new indirect block
+int store_extents(mkfs_file_directory* file, mkfs_extent_map* map) {
+    int i;
+    int n = map->nExtents;
+    int needed = 0;
+    if (n > MAX_INLINE_EXTENTS) {
+        needed = (n - MAX_INLINE_EXTENTS + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK;
+    }
+    int first = needed;
+    if (map->dirty_from < n || map->dirty_from < map->nStored) { //first indirect block which changed
+        first = map->dirty_from > MAX_INLINE_EXTENTS ? (map->dirty_from - MAX_INLINE_EXTENTS) / MAX_EXTENTS_IN_BLOCK : 0;
+    }
+
+    //the last block which stays in the chain gets a new next pointer
+    int kept = map->nIndirect < needed ? map->nIndirect : needed;
+    if (map->nIndirect != needed && kept > 0 && first > kept - 1) {
+        first = kept - 1;
+    }
+    while (map->nIndirect > needed) {
+        free_meta_block(map->indirect[--map->nIndirect]);
+    }
+    while (map->nIndirect < needed) {
+        int got;
+        int goal = map->nIndirect > 0 ? map->indirect[map->nIndirect - 1] + 1 : -1;
+        int block = allocate_extent(goal, 1, &got);
+        if (block == -1) return -1;
+        map->indirect = realloc(map->indirect, (map->nIndirect + 1) * sizeof(int));
+        map->indirect[map->nIndirect++] = block;
+    }
+    if (first > needed) first = needed;
+
+    file->nExtents = n;
+    file->nIndirectBlock = needed > 0 ? map->indirect[0] : -1;
+    file->flags &= ~FILE_SPARSE;
+    for (i = 0; i < n; i++) {
+        if (map->extents[i].nStartBlock == HOLE_BLOCK) {
+            file->flags |= FILE_SPARSE;
+            break;
+        }
+    }
+    for (i = 0; i < MAX_INLINE_EXTENTS && i < n; i++) {
+        file->extents[i] = map->extents[i];
+    }
+
+    mkfs_indirect_block* indirect = first < needed ? malloc(block_size) : NULL;
+    for (i = first; i < needed; i++) {
+        memset(indirect, 0, block_size);
+        int from = MAX_INLINE_EXTENTS + i * MAX_EXTENTS_IN_BLOCK;
+        indirect->nNextBlock = i + 1 < needed ? map->indirect[i + 1] : -1;
+        indirect->nExtents = n - from < MAX_EXTENTS_IN_BLOCK ? n - from : MAX_EXTENTS_IN_BLOCK;
+        memcpy(indirect->extents, map->extents + from, indirect->nExtents * sizeof(mkfs_extent));
+        meta_write(TARGET_DISK, indirect, block_size, (off_t) map->indirect[i] * block_size);
+    }
+    free(indirect);
+    map->dirty_from = n;
+    map->nStored = n;
+    return 0;
+}
+
+void release_extents(mkfs_extent_map* map) {
+    free(map->extents);
+    free(map->ends);
+    free(map->indirect);
+    memset(map, 0, sizeof(*map));
+}
+
+//returns how many blocks the file has
+int map_blocks(mkfs_extent_map* map) {
+    return map->nExtents > 0 ? map->ends[map->nExtents - 1] : 0;
+}
+
+//returns how many of the blocks of the file are on disk, holes left out
+int data_blocks(mkfs_extent_map* map) {
+    int blocks = 0;
+    int i;
+    for (i = 0; i < map->nExtents; i++) {
+        if (map->extents[i].nStartBlock != HOLE_BLOCK) blocks += map->extents[i].nBlocks;
+    }
+    return blocks;
+}
+
+//returns the first extent which ends after file_block, nExtents if the file is not that long
+static int find_extent(mkfs_extent_map* map, int file_block) {
+    int lo = 0;
+    int hi = map->nExtents;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->ends[mid] <= file_block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//returns block file_block of the file as the nStartBlock of an extent of its own (its disk block, HOLE_BLOCK or
+//UNWRITTEN_BLOCK) and stores in run how many blocks of the same extent follow it (itself included). returns -1 if
+//the file is not that long
+static int map_start(mkfs_extent_map* map, int file_block, int* run) {
+    int i = find_extent(map, file_block);
+    if (i == map->nExtents) return -1;
+    *run = map->ends[i] - file_block;
+    return skip_blocks(map->extents[i].nStartBlock, map->extents[i].nBlocks - *run);
+}
+
+//returns the disk block holding block file_block of the file and stores in run how many blocks of the same
+//extent follow it (itself included). returns HOLE_BLOCK if it is in a hole or was never written, so it reads as
+//zeros, or -1 if the file is not that long
+int map_block(mkfs_extent_map* map, int file_block, int* run) {
+    int block = map_start(map, file_block, run);
+    return block < HOLE_BLOCK ? HOLE_BLOCK : block;
+}
+
+//returns whether bytes [offset, offset + size) of the file touch a hole
+int map_sparse(mkfs_extent_map* map, off_t offset, size_t size) {
+    if (size == 0) return 0;
+    int block = offset / block_size;
+    int last = (offset + size - 1) / block_size;
+    while (block <= last) {
+        int run;
+        int disk_block = map_block(map, block, &run);
+        if (disk_block == -1) return 0;
+        if (disk_block == HOLE_BLOCK) return 1;
+        block += run;
+    }
+    return 0;
+}
+
+//returns the disk block after the last block of the file which is on disk, -1 if it has none
+static int map_goal(mkfs_extent_map* map) {
+    int i;
+    for (i = map->nExtents - 1; i >= 0; i--) {
+        if (map->extents[i].nStartBlock != HOLE_BLOCK) {
+            return disk_start(map->extents[i].nStartBlock) + map->extents[i].nBlocks;
+        }
+    }
+    return -1;
+}
+
+//makes blocks [file_block, file_block + num_blocks) of the file the run starting at start_block, which may be
+//HOLE_BLOCK or UNWRITTEN_BLOCK as well. the blocks they had are not freed. the range has to be inside the map
+void set_range(mkfs_extent_map* map, int file_block, int num_blocks, int start_block) {
+    int i = find_extent(map, file_block);
+    int j = find_extent(map, file_block + num_blocks - 1);
+    mkfs_extent head = map->extents[i];
+    head.nBlocks = file_block - (map->ends[i] - map->extents[i].nBlocks);
+    mkfs_extent tail = map->extents[j];
+    int cut = map->ends[j] - (file_block + num_blocks); //blocks of extent j after the range
+    tail.nStartBlock = skip_blocks(tail.nStartBlock, tail.nBlocks - cut);
+    tail.nBlocks = cut;
+
+    //cut the map back to extent i and push the rest again, so runs which meet are merged
+    int nrest = map->nExtents - j - 1;
+    mkfs_extent* rest = malloc((nrest > 0 ? nrest : 1) * sizeof(mkfs_extent));
+    memcpy(rest, map->extents + j + 1, nrest * sizeof(mkfs_extent));
+    map->nExtents = i;
+    if (map->dirty_from > i) map->dirty_from = i;
+    if (head.nBlocks > 0) push_extent(map, head.nStartBlock, head.nBlocks);
+    push_extent(map, start_block, num_blocks);
+    if (tail.nBlocks > 0) push_extent(map, tail.nStartBlock, tail.nBlocks);
+    int k;
+    for (k = 0; k < nrest; k++) {
+        push_extent(map, rest[k].nStartBlock, rest[k].nBlocks);
+    }
+    free(rest);
+}
+
+//writes zeros over bytes [from, to) of the file, leaving out holes
+void zero_range(mkfs_extent_map* map, off_t from, off_t to) {
+    char* zeros = NULL;
+    size_t zeros_len = 0;
+    while (from < to) {
+        int run;
+        int block = map_block(map, from / block_size, &run);
+        if (block == -1) break;
+        size_t len = (size_t) run * block_size - from % block_size;
+        if (len > to - from) len = to - from;
+        if (block != HOLE_BLOCK) {
+            if (len > zeros_len) {
+                free(zeros);
+                zeros = calloc(1, len);
+                zeros_len = len;
+            }
+            image_write(zeros, len, (off_t) block * block_size + from % block_size);
+        }
+        from += len;
+    }
+    free(zeros);
+}
+
+//gives blocks to the holes in bytes [offset, offset + size) of the file and stores the extents. for fallocate
+//(reserve == 1) the new blocks are left unwritten. before a write in place (reserve == 0) the unwritten blocks there
+//become written as well, and what the write leaves of the first and last block of each run is zeroed. returns -1
+//(and leaves the file as it was) if the disk is full.
+//the caller holds of->lock for writing
+int fill_holes(mkfs_file_directory* file, mkfs_extent_map* map, off_t offset, size_t size, int reserve) {
+    if (size == 0) return 0;
+    int block = offset / block_size;
+    int last = (offset + size - 1) / block_size;
+    mkfs_extent* filled = NULL; //nStartBlock is the file block of what was filled, to undo it
+    int* was = NULL; //the nStartBlock the filled blocks had, HOLE_BLOCK or UNWRITTEN_BLOCK
+    int nfilled = 0;
+    int res = 0;
+    while (block <= last) {
+        int run;
+        int start = map_start(map, block, &run);
+        if (start == -1) break;
+        if (run > last - block + 1) run = last - block + 1;
+        if (start >= 0 || (start != HOLE_BLOCK && reserve)) {
+            block += run;
+            continue;
+        }
+
+        int got = run;
+        if (start == HOLE_BLOCK) {
+            int before = block > 0 ? map_start(map, block - 1, &got) : -1; //right behind the data in front of it
+            int goal = before >= 0 || before < HOLE_BLOCK ? disk_start(before) + 1 : -1;
+            int disk_block = allocate_extent(goal, run, &got);
+            if (disk_block == -1) {
+                res = -1;
+                break;
+            }
+            set_range(map, block, got, reserve ? UNWRITTEN_BLOCK(disk_block) : disk_block);
+        } else {
+            set_range(map, block, run, disk_start(start));
+        }
+        filled = realloc(filled, (nfilled + 1) * sizeof(mkfs_extent));
+        was = realloc(was, (nfilled + 1) * sizeof(int));
+        filled[nfilled].nStartBlock = block;
+        filled[nfilled].nBlocks = got;
+        was[nfilled++] = start;
+
+        if (!reserve) {
+            off_t from = (off_t) block * block_size;
+            off_t to = (off_t) (block + got) * block_size;
+            if (from < offset) zero_range(map, from, offset);
+            if (to > offset + (off_t) size) zero_range(map, offset + size, to);
+        }
+        block += got;
+    }
+    if (res == 0 && nfilled > 0 && store_extents(file, map) == -1) res = -1;
+    if (res == -1 && nfilled > 0) {
+        int i;
+        for (i = 0; i < nfilled; i++) {
+            int run;
+            int disk_block = disk_start(map_start(map, filled[i].nStartBlock, &run));
+            set_range(map, filled[i].nStartBlock, filled[i].nBlocks, was[i]);
+            if (was[i] == HOLE_BLOCK) unallocate(disk_block, filled[i].nBlocks);
+        }
+        store_extents(file, map);
+    }
+    free(filled);
+    free(was);
+    return res;
+}
+
+//makes blocks [file_block, file_block + num_blocks) of the file a hole and stores the extents, the blocks they had
+//are freed once that is committed. returns -1 (and leaves them) if there is no space for a new indirect block
+int punch_blocks(mkfs_file_directory* file, mkfs_extent_map* map, int file_block, int num_blocks) {
+    mkfs_extent* punched = NULL; //nStartBlock is the file block of what was punched, to undo it
+    int* starts = NULL;
+    int npunched = 0;
+    int block = file_block;
+    int end = file_block + num_blocks;
+    while (block < end) {
+        int run;
+        int start = map_start(map, block, &run);
+        if (start == -1) break;
+        if (run > end - block) run = end - block;
+        if (start != HOLE_BLOCK) {
+            punched = realloc(punched, (npunched + 1) * sizeof(mkfs_extent));
+            starts = realloc(starts, (npunched + 1) * sizeof(int));
+            punched[npunched].nStartBlock = block;
+            punched[npunched].nBlocks = run;
+            starts[npunched++] = start;
+        }
+        block += run;
+    }
+
+    int res = 0;
+    int i;
+    if (npunched > 0) {
+        set_range(map, file_block, block - file_block, HOLE_BLOCK);
+        if (store_extents(file, map) == -1) {
+            for (i = 0; i < npunched; i++) {
+                set_range(map, punched[i].nStartBlock, punched[i].nBlocks, starts[i]);
+            }
+            store_extents(file, map);
+            res = -1;
+        } else {
+            for (i = 0; i < npunched; i++) {
+                free_after_commit(disk_start(starts[i]), punched[i].nBlocks);
+            }
+        }
+    }
+    free(punched);
+    free(starts);
+    return res;
+}
+
+//gives the file at least num_blocks blocks, growing its last extent in place whenever the next blocks are free.
+//returns -1 (and leaves the file as it was) if there is not enough space
+int extend_file(mkfs_extent_map* map, int num_blocks) {
+    int had = map_blocks(map);
+    int have = had;
+    while (have < num_blocks) {
+        int got;
+        int goal = map_goal(map);
+        int start = allocate_extent(goal, num_blocks - have, &got);
+        if (start == -1) {
+            shrink_file(map, had);
+            return -1;
+        }
+        if (goal >= 0 && start != goal) count_event(&stats.relocations, 1);
+        push_extent(map, start, got);
+        have += got;
+    }
+    return 0;
+}
+
+//drops every block of the file past the first num_blocks. they are freed now, or once the change is committed if
+//deferred is set, because the committed extents still point at them
+static void drop_blocks(mkfs_extent_map* map, int num_blocks, int deferred) {
+    while (map->nExtents > 0) {
+        int n = map->nExtents;
+        mkfs_extent* last = &map->extents[n - 1];
+        int first_block = map->ends[n - 1] - last->nBlocks;
+        if (map->ends[n - 1] <= num_blocks) break;
+        int cut = first_block >= num_blocks ? last->nBlocks : map->ends[n - 1] - num_blocks;
+        if (last->nStartBlock != HOLE_BLOCK) {
+            int start = disk_start(last->nStartBlock) + last->nBlocks - cut;
+            if (deferred) {
+                free_after_commit(start, cut);
+            } else {
+                unallocate(start, cut);
+            }
+        }
+        if (map->dirty_from > n - 1) map->dirty_from = n - 1;
+        if (cut == last->nBlocks) {
+            map->nExtents--;
+        } else {
+            last->nBlocks -= cut;
+            map->ends[n - 1] = num_blocks;
+            break;
+        }
+    }
+}
+
+//frees every block of the file past the first num_blocks
+void shrink_file(mkfs_extent_map* map, int num_blocks) {
+    drop_blocks(map, num_blocks, 0);
+}
+
+//frees the blocks and indirect extent blocks of a map once the change which stops using them is committed, the
+//committed record still points at them until then
+void free_map(mkfs_extent_map* map) {
+    int i;
+    for (i = 0; i < map->nExtents; i++) {
+        if (map->extents[i].nStartBlock != HOLE_BLOCK) {
+            free_after_commit(disk_start(map->extents[i].nStartBlock), map->extents[i].nBlocks);
+        }
+    }
+    for (i = 0; i < map->nIndirect; i++) {
+        free_meta_block(map->indirect[i]);
+    }
+    release_extents(map);
+}
+
+//frees the blocks and indirect extent blocks of a file
+void free_file(mkfs_file_directory* file) {
+    if (file->nExtents < 0) {
+        release_small(file);
+        return;
+    }
+    mkfs_extent_map map;
+    load_extents(file, &map);
+    free_map(&map);
+    file->nExtents = 0;
+    file->nIndirectBlock = -1;
+}
+
+//runs the transfers io_extents queued, in one batch. if one came up short done is moved back to where it ended
+//and -1 is returned
+static int run_extent_batch(struct mkfs_io* ios, int n, char* buf, size_t* done) {
+    image_rw(ios, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        if (ios[i].res < (ssize_t) ios[i].size) {
+            *done = ios[i].buf - buf + (ios[i].res > 0 ? ios[i].res : 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//reads (write == 0) or writes size bytes at offset of the file, one extent at a time. holes read as zeros and stop
+//a write, fill_holes gives them blocks first. with the ring up to RING_BATCH extents go out together, unless reads
+//go through the cache. returns how many bytes it moved
+int io_extents(mkfs_extent_map* map, char* buf, size_t size, off_t offset, int write) {
+    struct mkfs_io ios[RING_BATCH];
+    int n = 0;
+    int batch = ring.fd != -1 && (write || cache.nslots == 0);
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        int run;
+        int block = map_block(map, pos / block_size, &run);
+        if (block == -1 || (block == HOLE_BLOCK && write)) break;
+
+        size_t len = (size_t) run * block_size - pos % block_size;
+        if (len > size - done) len = size - done;
+        if (block == HOLE_BLOCK) {
+            memset(buf + done, 0, len);
+            done += len;
+            continue;
+        }
+        off_t disk_pos = (off_t) block * block_size + pos % block_size;
+        if (batch) {
+            ios[n] = (struct mkfs_io) { .buf = buf + done, .size = len, .offset = disk_pos, .write = write };
+            done += len;
+            if (++n == RING_BATCH) {
+                if (run_extent_batch(ios, n, buf, &done) != 0) return done;
+                n = 0;
+            }
+            continue;
+        }
+        ssize_t moved = write ? image_write(buf + done, len, disk_pos) : cache_read(buf + done, len, disk_pos);
+        if (moved <= 0) break;
+        done += moved;
+        if (moved < len) break;
+    }
+    if (n > 0) run_extent_batch(ios, n, buf, &done);
+    return done;
+}
+
+//describes size bytes at offset of the file as buffers on the .disk descriptor, one per extent it touches,
+//so FUSE can splice them without copying through user space. the range must not touch a hole. the caller frees
+//the vector
+struct fuse_bufvec* extent_bufvec(mkfs_extent_map* map, size_t size, off_t offset) {
+    int count = 0;
+    size_t done = 0;
+    while (done < size) { //count the pieces first
+        int run;
+        off_t pos = offset + done;
+        if (map_block(map, pos / block_size, &run) == -1) break;
+        done += (size_t) run * block_size - pos % block_size;
+        count++;
+    }
+
+    struct fuse_bufvec* bufv = calloc(1, sizeof(struct fuse_bufvec) + (count > 0 ? count - 1 : 0) * sizeof(struct fuse_buf));
+    bufv->count = count;
+    done = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        int run;
+        off_t pos = offset + done;
+        int block = map_block(map, pos / block_size, &run);
+        size_t len = (size_t) run * block_size - pos % block_size;
+        if (len > size - done) len = size - done;
+
+        bufv->buf[i].size = len;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        bufv->buf[i].fd = image.fd;
+        bufv->buf[i].pos = (off_t) block * block_size + pos % block_size;
+        done += len;
+    }
+    return bufv;
+}
+
+//spots a sequential stream on the open file and queues the blocks after it for the readahead thread.
+//the window starts at READAHEAD_MIN blocks and doubles up to the readahead= mount option. the caller holds of->lock
+void readahead_file(mkfs_open_file* of, off_t offset, size_t size) {
+    int max_window = (int) ((off_t) options.readahead_kb * 1024 / block_size);
+    if (cache.nslots == 0 || max_window == 0 || size == 0) return;
+
+    off_t from = 0;
+    off_t to = 0;
+    pthread_mutex_lock(&of->stream_lock);
+    if (offset == of->next_read) {
+        of->seq_reads++;
+    } else { //a seek, start over
+        of->seq_reads = 0;
+        of->ra_end = 0;
+        of->ra_window = READAHEAD_MIN;
+    }
+    of->next_read = offset + size;
+
+    //read ahead again once the reader got into the second half of what was read ahead last time
+    off_t window = (off_t) of->ra_window * block_size;
+    if (of->seq_reads >= SEQUENTIAL_READS && offset + size + window / 2 >= of->ra_end) {
+        from = of->ra_end > offset + size ? of->ra_end : offset + size;
+        to = offset + size + window;
+        if (to > of->file->fsize) to = of->file->fsize;
+        if (to > from) of->ra_end = to;
+        if (of->ra_window < max_window) of->ra_window = of->ra_window * 2 < max_window ? of->ra_window * 2 : max_window;
+    }
+    pthread_mutex_unlock(&of->stream_lock);
+
+    //queue it one extent at a time
+    int block = from / block_size;
+    int last = to > 0 ? (to - 1) / block_size : -1;
+    while (block <= last) {
+        int run;
+        int disk_block = map_block(&of->map, block, &run);
+        if (disk_block == -1) break;
+        if (run > last - block + 1) run = last - block + 1;
+        if (disk_block != HOLE_BLOCK) cache_readahead(disk_block, run);
+        block += run;
+    }
+}
+
+//rewrites a .dir of records from before extents in the current format. the new records go to .dir.new which is
+//renamed over .dir, so a crash leaves one or the other. returns 0 if .dir is not of that format or has been
+//converted, -1 if it cannot be
+int convert_original_dir() {
+    struct stat st;
+    if (stat(".dir", &st) == -1 || st.st_size == 0) return 0;
+    //a record is never as large as it was before, so the size tells the formats apart
+    if (st.st_size % sizeof(struct mkfs_original_directory_entry) != 0 || st.st_size % sizeof(mkfs_directory_entry) == 0) return 0;
+
+    int nrecords = st.st_size / sizeof(struct mkfs_original_directory_entry);
+    struct mkfs_original_directory_entry* old = malloc(st.st_size);
+    //the header, then as many pages per directory as its files need
+    int max_entries = 1 + nrecords * ((ORIGINAL_FILES_IN_DIR + FILES_PER_RECORD - 1) / FILES_PER_RECORD);
+    mkfs_directory_entry* entries = calloc(max_entries, sizeof(mkfs_directory_entry));
+    FILE* f = fopen(".dir", "rb");
+    int ok = f != NULL && fread(old, sizeof(*old), nrecords, f) == (size_t) nrecords;
+    if (f != NULL) fclose(f);
+    ok = ok && block_size == DEFAULT_BLOCK_SIZE; //images of that time have no superblock
+    dir_header(&entries[0]);
+    int nentries = 1;
+    int i, j, p;
+    for (i = 0; ok && i < nrecords; i++) {
+        ok = memchr(old[i].dname, 0, sizeof(old[i].dname)) != NULL && old[i].nFiles >= 0 && old[i].nFiles <= ORIGINAL_FILES_IN_DIR;
+        if (!ok) break;
+        mkfs_directory_entry* pages = &entries[nentries];
+        int npages = old[i].nFiles == 0 ? 1 : (old[i].nFiles + FILES_PER_RECORD - 1) / FILES_PER_RECORD;
+        for (p = 0; p < npages; p++) {
+            strcpy(pages[p].dname, old[i].dname);
+            pages[p].nPage = p;
+        }
+        nentries += npages;
+        for (j = 0; ok && j < old[i].nFiles; j++) {
+            mkfs_directory_entry* entry = &pages[j / FILES_PER_RECORD];
+            mkfs_file_directory* file = &entry->files[entry->nFiles++];
+            int nblocks = (old[i].files[j].fsize + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE;
+            ok = memchr(old[i].files[j].fname, 0, sizeof(file->fname)) != NULL && memchr(old[i].files[j].fext, 0, sizeof(file->fext)) != NULL;
+            ok = ok && (nblocks == 0 || (old[i].files[j].nStartBlock >= 0 && old[i].files[j].nStartBlock + nblocks <= bitmap.nblocks));
+            if (!ok) break;
+            strcpy(file->fname, old[i].files[j].fname);
+            strcpy(file->fext, old[i].files[j].fext);
+            file->fsize = old[i].files[j].fsize;
+            file->nIndirectBlock = -1;
+            if (nblocks > 0) {
+                file->nExtents = 1;
+                file->extents[0].nStartBlock = old[i].files[j].nStartBlock;
+                file->extents[0].nBlocks = nblocks;
+            }
+        }
+    }
+    free(old);
+    if (!ok) {
+        log_error("Cannot convert .dir, it is not of the format before extents");
+        free(entries);
+        return -1;
+    }
+
+    f = fopen(".dir.new", "wb");
+    ok = f != NULL && fwrite(entries, sizeof(mkfs_directory_entry), nentries, f) == (size_t) nentries;
+    ok = f != NULL && fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    if (f != NULL) fclose(f);
+    free(entries);
+    if (!ok || rename(".dir.new", ".dir") == -1) {
+        log_error("Cannot write the converted .dir");
+        unlink(".dir.new");
+        return -1;
+    }
+    //the journal opened .dir before it was converted
+    if (journal.dir_fd != -1) {
+        close(journal.dir_fd);
+        journal.dir_fd = open(".dir", O_RDWR);
+    }
+    log_info("Converted %d records of .dir to extents", nrecords);
+    return 0;
+}
+//File extents--------------------------------------------------------------------------------------------end->
+//Delayed allocation------------------------------------------------------------------------------------start->
+//Writes inside the blocks a file already has go straight to disk. Data past them is kept in the open file's tail
+//and only gets blocks when the file is flushed, synced, released, when too much data is buffered or when it gets
+//old, so a file streamed in small writes is placed with one allocation when its size is known.
+
+size_t delalloc_bytes = 0; //Bytes buffered in the tails of all open files
+
+//blocks to reserve for a tail of len bytes, counting the indirect blocks the file could need if every
+//block of the tail ends up in its own extent
+static int tail_blocks(mkfs_extent_map* map, size_t len) {
+    int blocks = (len + block_size - 1) / block_size;
+    int extents = map->nExtents + blocks - MAX_INLINE_EXTENTS;
+    int indirect = extents > 0 ? (extents + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK : 0;
+    return blocks + (indirect > map->nIndirect ? indirect - map->nIndirect : 0);
+}
+
+//makes room for a tail of len bytes and reserves blocks for it. returns -1 if the disk cannot hold it.
+//the caller holds of->lock for writing
+int grow_tail(mkfs_open_file* of, size_t len) {
+    int need = tail_blocks(&of->map, len) - of->reserved;
+    if (need > 0) {
+        if (reserve_blocks(need, 0) == -1) return -1;
+        of->reserved += need;
+    }
+    if (len > of->tail_cap) {
+        size_t cap = of->tail_cap == 0 ? 4 * block_size : of->tail_cap;
+        while (cap < len) cap *= 2;
+        of->tail = realloc(of->tail, cap);
+        of->tail_cap = cap;
+    }
+    if (of->tail_len == 0) of->tail_since = time(NULL);
+    return 0;
+}
+
+//gives the tail of an open file blocks of its own and writes it out, see flush_tail
+static int place_tail(mkfs_open_file* of, mkfs_dir* dir, int speculative) {
+    int had = map_blocks(&of->map);
+    int blocks = had + (of->tail_len + block_size - 1) / block_size;
+    int extra = 0;
+    if (speculative) {
+        extra = (int) ((off_t) PREALLOC_KB * 1024 / block_size);
+        if (extra > blocks) extra = blocks;
+    }
+
+    int reserved = of->reserved;
+    unreserve_blocks(reserved);
+    of->reserved = 0;
+    int res = -1;
+    if (extra > 0) res = extend_file(&of->map, blocks + extra);
+    if (res == -1) res = extend_file(&of->map, blocks);
+    if (res == 0 && store_extents(of->file, &of->map) == -1) {
+        shrink_file(&of->map, had);
+        store_extents(of->file, &of->map);
+        res = -1;
+    }
+    if (res == -1) {
+        reserve_blocks(reserved, 1);
+        of->reserved = reserved;
+        log_error("FLUSH: No space for %zu buffered bytes", of->tail_len);
+        return -ENOSPC;
+    }
+
+    log_debug("FLUSH: %zu buffered bytes got %d blocks (+%d preallocated) in %d extents",
+            of->tail_len, blocks - had, map_blocks(&of->map) - blocks, of->map.nExtents);
+    io_extents(&of->map, of->tail, of->tail_len, (off_t) had * block_size, 1);
+    drop_tail(of);
+    of->generation++;
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+    return 0;
+}
+
+//gives the tail of an open file its blocks and writes it out, or packs it if it is all of a small file.
+//speculative adds up to PREALLOC_KB of blocks past the end (as much as the file already has) for a file which
+//stays open, so its next appends land next to it. the caller holds of->lock for writing and the directory of the
+//file. returns -ENOSPC (and keeps the tail) if the disk is full
+int flush_tail(mkfs_open_file* of, mkfs_dir* dir, int speculative) {
+    if (of->tail_len == 0) return 0;
+    if (of->map.nExtents == 0 && of->tail_len == of->file->fsize && of->tail_len <= PACKED_MAX) {
+        return pack_file(of, dir);
+    }
+    return place_tail(of, dir, speculative);
+}
+
+//makes the bytes between the end of the file and offset, where a write starts, read as zeros. blocks preallocated
+//there are zeroed and whole blocks past everything the file holds become a hole, the write zeroes the rest in the
+//tail. returns -ENOSPC if the tail had to be placed in front of the hole and could not be.
+//the caller holds of->lock for writing and the directory of the file
+int fill_gap(mkfs_open_file* of, mkfs_dir* dir, off_t offset) {
+    off_t alloc_end = (off_t) map_blocks(&of->map) * block_size;
+    if (of->tail_len > 0 && offset / block_size > (alloc_end + of->tail_len + block_size - 1) / block_size) {
+        int res = place_tail(of, dir, 0);
+        if (res != 0) return res;
+        alloc_end = (off_t) map_blocks(&of->map) * block_size;
+    }
+    if (of->file->fsize < alloc_end) { //preallocated blocks still hold whatever was there before
+        zero_range(&of->map, of->file->fsize, offset < alloc_end ? offset : alloc_end);
+    }
+    if (of->tail_len == 0 && offset / block_size > alloc_end / block_size) {
+        push_extent(&of->map, HOLE_BLOCK, offset / block_size - alloc_end / block_size);
+        of->file->flags |= FILE_SPARSE; //the extents are stored with the tail
+        of->generation++;
+    }
+    return 0;
+}
+
+//forgets the tail of an open file and gives back its reservation
+void drop_tail(mkfs_open_file* of) {
+    __atomic_sub_fetch(&delalloc_bytes, of->tail_len, __ATOMIC_RELAXED);
+    unreserve_blocks(of->reserved);
+    free(of->tail);
+    of->tail = NULL;
+    of->tail_len = 0;
+    of->tail_cap = 0;
+    of->reserved = 0;
+}
+
+//frees the blocks preallocated past the end of the file, but not those fallocate reserved.
+//the caller holds of->lock for writing and the directory
+void trim_file(mkfs_open_file* of, mkfs_dir* dir) {
+    int needed = (of->file->fsize + block_size - 1) / block_size;
+    if (needed < of->fallocated) needed = of->fallocated;
+    if (map_blocks(&of->map) <= needed) return;
+    shrink_file(&of->map, needed);
+    store_extents(of->file, &of->map);
+    of->generation++;
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+}
+//Delayed allocation--------------------------------------------------------------------------------------end->
+//Small files-------------------------------------------------------------------------------------------start->
+//A file of up to INLINE_DATA_SIZE bytes keeps its data in its directory record, one of up to PACKED_MAX bytes in a
+//run of fragments of a packed block it shares with other small files. Either way it takes no block of its own and
+//is read without looking at its extents. It is packed when its tail is flushed and it has no blocks, and a write
+//moves its data back into the tail.
+
+static int fragments_for(size_t len) {
+    return (len + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+}
+
+static uint64_t fragment_mask(int first, int num_fragments) {
+    return (num_fragments == PACKED_FRAGMENTS ? ~0ULL : (1ULL << num_fragments) - 1) << first;
+}
+
+//index of the first packed block at or behind block. the caller holds packed.lock
+static int packed_slot(int block) {
+    int lo = 0;
+    int hi = packed.nblocks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (packed.blocks[mid].block < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//marks fragments as used, adding their block to the table. the caller holds packed.lock
+static int use_fragments(int block, int first, int num_fragments) {
+    int i = packed_slot(block);
+    if (i == packed.nblocks || packed.blocks[i].block != block) {
+        if (packed.nblocks == packed.capacity) {
+            packed.capacity = packed.capacity == 0 ? 64 : packed.capacity * 2;
+            packed.blocks = realloc(packed.blocks, packed.capacity * sizeof(mkfs_packed_block));
+        }
+        memmove(&packed.blocks[i + 1], &packed.blocks[i], (packed.nblocks - i) * sizeof(mkfs_packed_block));
+        packed.nblocks++;
+        packed.blocks[i].block = block;
+        packed.blocks[i].used = 0;
+    }
+    packed.blocks[i].used |= fragment_mask(first, num_fragments);
+    return i;
+}
+
+//rebuilds the packed block table from the records of every packed file, after load_dirs
+void load_packed() {
+    pthread_mutex_lock(&packed.lock);
+    int i;
+    for (i = 0; i < dirs.ndirs; i++) {
+        mkfs_dir* dir = dirs.dirs[i];
+        int j;
+        for (j = 0; j < dir_slots(dir); j++) {
+            mkfs_file_directory* file = dir_file(dir, j);
+            if (file->fname[0] != 0 && file->nExtents == DATA_PACKED) {
+                use_fragments(file->nPackedBlock, file->nPackedFragment, fragments_for(file->fsize));
+            }
+        }
+    }
+    packed.cursor = 0;
+    log_debug("Loaded %d packed blocks", packed.nblocks);
+    pthread_mutex_unlock(&packed.lock);
+}
+
+void release_packed() {
+    free(packed.blocks);
+    free(packed.freed);
+    packed.blocks = NULL;
+    packed.freed = NULL;
+    packed.nblocks = packed.capacity = packed.cursor = 0;
+    packed.nfreed = packed.freed_capacity = 0;
+}
+
+//takes num_fragments contiguous fragments from one of the PACKED_SCAN packed blocks behind the cursor, or from a
+//new packed block. returns the block and stores the first fragment in first, or returns -1 if the disk is full
+int allocate_fragments(int num_fragments, int* first) {
+    pthread_mutex_lock(&packed.lock);
+    int block = -1;
+    int n;
+    for (n = 0; n < PACKED_SCAN && n < packed.nblocks && block == -1; n++) {
+        int i = (packed.cursor + n) % packed.nblocks;
+        int pos;
+        for (pos = 0; pos + num_fragments <= PACKED_FRAGMENTS; pos++) {
+            if ((packed.blocks[i].used & fragment_mask(pos, num_fragments)) == 0) {
+                packed.blocks[i].used |= fragment_mask(pos, num_fragments);
+                packed.cursor = i;
+                block = packed.blocks[i].block;
+                *first = pos;
+                break;
+            }
+        }
+    }
+    if (block == -1) {
+        int got;
+        int goal = packed.nblocks > 0 ? packed.blocks[packed.cursor].block + 1 : -1; //right behind the one in use
+        block = allocate_extent(goal, 1, &got);
+        if (block != -1) {
+            packed.cursor = use_fragments(block, 0, num_fragments);
+            *first = 0;
+        }
+    }
+    pthread_mutex_unlock(&packed.lock);
+    return block;
+}
+
+//gives fragments back once the transaction that stops using them is committed, so no other small file is
+//written over them while the committed record still points at them
+void free_fragments(int block, int first, int num_fragments) {
+    pthread_mutex_lock(&packed.lock);
+    if (packed.nfreed == packed.freed_capacity) {
+        packed.freed_capacity = packed.freed_capacity == 0 ? 16 : packed.freed_capacity * 2;
+        packed.freed = realloc(packed.freed, packed.freed_capacity * sizeof(mkfs_fragment_run));
+    }
+    packed.freed[packed.nfreed++] = (mkfs_fragment_run) { .block = block, .first = first, .num_fragments = num_fragments };
+    pthread_mutex_unlock(&packed.lock);
+}
+
+//takes the fragments freed so far, for the commit which is taking its snapshot. the caller frees the list
+mkfs_fragment_run* take_freed_fragments(int* n) {
+    pthread_mutex_lock(&packed.lock);
+    mkfs_fragment_run* runs = packed.freed;
+    *n = packed.nfreed;
+    packed.freed = NULL;
+    packed.nfreed = packed.freed_capacity = 0;
+    pthread_mutex_unlock(&packed.lock);
+    return runs;
+}
+
+//makes fragments free for good once their commit is done, and the blocks which are left with none used
+void reuse_fragments(mkfs_fragment_run* runs, int n) {
+    pthread_mutex_lock(&packed.lock);
+    int r;
+    for (r = 0; r < n; r++) {
+        int i = packed_slot(runs[r].block);
+        if (i == packed.nblocks || packed.blocks[i].block != runs[r].block) continue;
+        packed.blocks[i].used &= ~fragment_mask(runs[r].first, runs[r].num_fragments);
+        if (packed.blocks[i].used == 0) {
+            memmove(&packed.blocks[i], &packed.blocks[i + 1], (packed.nblocks - i - 1) * sizeof(mkfs_packed_block));
+            packed.nblocks--;
+            if (packed.cursor >= packed.nblocks) packed.cursor = 0;
+            unallocate(runs[r].block, 1);
+        }
+    }
+    pthread_mutex_unlock(&packed.lock);
+}
+
+//reads size bytes at offset of a DATA_INLINE or DATA_PACKED file, returns how many were read
+int read_small(mkfs_file_directory* file, char* buf, size_t size, off_t offset) {
+    if (offset >= file->fsize) return 0;
+    if (file->fsize - offset < size) size = file->fsize - offset;
+    if (file->nExtents == DATA_INLINE) {
+        memcpy(buf, file->data + offset, size);
+        return size;
+    }
+    off_t pos = (off_t) file->nPackedBlock * block_size + (off_t) file->nPackedFragment * FRAGMENT_SIZE + offset;
+    return cache_read(buf, size, pos);
+}
+
+//frees the fragments of a small file and leaves it with no data and no extents
+void release_small(mkfs_file_directory* file) {
+    if (file->nExtents == DATA_PACKED) {
+        free_fragments(file->nPackedBlock, file->nPackedFragment, fragments_for(file->fsize));
+    }
+    file->nExtents = 0;
+    file->nIndirectBlock = -1;
+}
+
+//stores the tail of a file which has no blocks and at most PACKED_MAX bytes in its record or in a packed block.
+//the caller holds of->lock for writing and the directory of the file. returns -ENOSPC (and keeps the tail) if
+//the disk is full
+int pack_file(mkfs_open_file* of, mkfs_dir* dir) {
+    mkfs_file_directory* file = of->file;
+    size_t len = of->tail_len;
+    if (len <= INLINE_DATA_SIZE) {
+        memcpy(file->data, of->tail, len);
+        file->nExtents = DATA_INLINE;
+    } else {
+        int reserved = of->reserved;
+        unreserve_blocks(reserved);
+        of->reserved = 0;
+        int first;
+        int block = allocate_fragments(fragments_for(len), &first);
+        if (block == -1) {
+            reserve_blocks(reserved, 1);
+            of->reserved = reserved;
+            log_error("FLUSH: No space for %zu buffered bytes", len);
+            return -ENOSPC;
+        }
+        image_write(of->tail, len, (off_t) block * block_size + (off_t) first * FRAGMENT_SIZE);
+        file->nPackedBlock = block;
+        file->nPackedFragment = first;
+        file->nExtents = DATA_PACKED;
+    }
+
+    log_debug("FLUSH: %zu bytes packed %s", len, file->nExtents == DATA_INLINE ? "in the record" : "in a shared block");
+    drop_tail(of);
+    of->generation++;
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+    return 0;
+}
+
+//moves the data of a small file back into its tail before it is written. returns -ENOSPC if no blocks can be
+//reserved for the tail. the caller holds of->lock for writing and the directory of the file
+int unpack_file(mkfs_open_file* of, mkfs_dir* dir) {
+    size_t len = of->file->fsize;
+    if (grow_tail(of, len) == -1) return -ENOSPC;
+    read_small(of->file, of->tail, len, 0);
+    __atomic_add_fetch(&delalloc_bytes, len - of->tail_len, __ATOMIC_RELAXED);
+    of->tail_len = len;
+    release_small(of->file);
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+    return 0;
+}
+
+//space a file takes on disk in the 512 byte units of st_blocks. of is the open file if it is open. only a sparse
+//file has its blocks counted, from its extents
+blkcnt_t stat_blocks(mkfs_file_directory* file, mkfs_open_file* of) {
+    if (file->nExtents == DATA_INLINE) return 0;
+    if (file->nExtents == DATA_PACKED) return ((off_t) fragments_for(file->fsize) * FRAGMENT_SIZE + 511) / 512;
+    if (!(file->flags & FILE_SPARSE)) return (file->fsize + block_size - 1) / block_size * (block_size / 512);
+    if (of != NULL) {
+        return ((off_t) data_blocks(&of->map) + (of->tail_len + block_size - 1) / block_size) * (block_size / 512);
+    } else {
+        mkfs_extent_map map;
+        load_extents(file, &map);
+        blkcnt_t blocks = (blkcnt_t) data_blocks(&map) * (block_size / 512);
+        release_extents(&map);
+        return blocks;
+    }
+}
+//Small files---------------------------------------------------------------------------------------------end->
+//File space--------------------------------------------------------------------------------------------start->
+//Size changes, reservations and punched holes. All of them hold of->lock for writing and the directory of the file,
+//and a small file is moved back into its tail first.
+
+//sets the size of an open file. one cut short drops its blocks past the new end, they are freed once the change is
+//committed. one made longer reads as zeros up to its new end, through a hole where it has no blocks.
+//returns -ENOSPC (and leaves the file as it was) if the disk is full
+int resize_file(mkfs_open_file* of, mkfs_dir* dir, off_t size) {
+    mkfs_file_directory* file = of->file;
+    size_t old_size = file->fsize;
+    if ((size_t) size == old_size) return 0;
+    if (file->nExtents < 0) {
+        if (size == 0) {
+            release_small(file);
+        } else if (unpack_file(of, dir) != 0) {
+            return -ENOSPC;
+        }
+    }
+
+    off_t alloc_end = (off_t) map_blocks(&of->map) * block_size;
+    int had = map_blocks(&of->map);
+    if ((size_t) size < old_size) {
+        if (of->tail_len > 0 && size <= alloc_end) {
+            drop_tail(of);
+        } else if (alloc_end + (off_t) of->tail_len > size) {
+            __atomic_sub_fetch(&delalloc_bytes, alloc_end + of->tail_len - size, __ATOMIC_RELAXED);
+            of->tail_len = size - alloc_end;
+        }
+        int keep = (size + block_size - 1) / block_size;
+        drop_blocks(&of->map, keep, 1);
+        if (of->fallocated > keep) of->fallocated = keep;
+    } else {
+        //a tail which ends before the last block of the new size is placed, so a hole can follow it
+        if (of->tail_len > 0 && (size + block_size - 1) / block_size > (alloc_end + of->tail_len + block_size - 1) / block_size) {
+            int res = place_tail(of, dir, 0);
+            if (res != 0) return res;
+            alloc_end = (off_t) map_blocks(&of->map) * block_size;
+            had = map_blocks(&of->map);
+        }
+        if ((off_t) old_size < alloc_end) { //blocks past the end still hold whatever was there before
+            zero_range(&of->map, old_size, size < alloc_end ? size : alloc_end);
+        }
+        if (of->tail_len > 0) { //the new end is in the last block of the tail
+            if (grow_tail(of, size - alloc_end) == -1) return -ENOSPC;
+            memset(of->tail + of->tail_len, 0, size - alloc_end - of->tail_len);
+            __atomic_add_fetch(&delalloc_bytes, size - alloc_end - of->tail_len, __ATOMIC_RELAXED);
+            of->tail_len = size - alloc_end;
+        } else if (size > alloc_end) {
+            push_extent(&of->map, HOLE_BLOCK, (size + block_size - 1) / block_size - had);
+        }
+    }
+
+    file->fsize = size;
+    if (store_extents(file, &of->map) == -1) { //only a longer file can need another indirect block
+        shrink_file(&of->map, had);
+        store_extents(file, &of->map);
+        file->fsize = old_size;
+        return -ENOSPC;
+    }
+    of->generation++;
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+    return 0;
+}
+
+//gives bytes [offset, offset + len) of an open file blocks, in one run past its end if the free space allows.
+//the new blocks are unwritten, so nothing has to zero them, and blocks past its end stay reserved when it is closed.
+//unless keep_size is set the file grows to offset + len. returns -ENOSPC (and gives back what it took) if the disk is full
+int allocate_file(mkfs_open_file* of, mkfs_dir* dir, off_t offset, off_t len, int keep_size) {
+    mkfs_file_directory* file = of->file;
+    if (file->nExtents < 0 && unpack_file(of, dir) != 0) return -ENOSPC;
+    if (of->tail_len > 0) {
+        int res = place_tail(of, dir, 0);
+        if (res != 0) return res;
+    }
+
+    int had = map_blocks(&of->map);
+    int blocks = (offset + len + block_size - 1) / block_size;
+    off_t alloc_end = (off_t) had * block_size;
+    if (offset < alloc_end) {
+        off_t end = offset + len < alloc_end ? offset + len : alloc_end;
+        if (fill_holes(file, &of->map, offset, end - offset, 1) == -1) return -ENOSPC;
+    }
+    if (blocks > had) {
+        if (extend_file(&of->map, blocks) == -1) return -ENOSPC;
+        int block = had;
+        while (block < blocks) {
+            int run;
+            int start = map_start(&of->map, block, &run);
+            set_range(&of->map, block, run, UNWRITTEN_BLOCK(start));
+            block += run;
+        }
+        if (store_extents(file, &of->map) == -1) {
+            shrink_file(&of->map, had);
+            store_extents(file, &of->map);
+            return -ENOSPC;
+        }
+        log_debug("FALLOCATE: %d blocks reserved in %d extents", blocks - had, of->map.nExtents);
+    }
+    if (of->fallocated < blocks) of->fallocated = blocks;
+    of->generation++;
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+    if (!keep_size && (size_t) (offset + len) > file->fsize) return resize_file(of, dir, offset + len);
+    return 0;
+}
+
+//makes bytes [offset, offset + len) of an open file read as zeros and keeps its size. whole blocks in it become a
+//hole, freed once that is committed, and the bytes around them are zeroed. returns -ENOSPC if the disk is full
+int punch_file(mkfs_open_file* of, mkfs_dir* dir, off_t offset, off_t len) {
+    mkfs_file_directory* file = of->file;
+    if ((size_t) offset >= file->fsize) return 0;
+    off_t end = (size_t) (offset + len) < file->fsize ? offset + len : (off_t) file->fsize;
+    if (file->nExtents < 0 && unpack_file(of, dir) != 0) return -ENOSPC;
+
+    off_t alloc_end = (off_t) map_blocks(&of->map) * block_size;
+    if (end > alloc_end) { //the part in the tail is zeroed there
+        off_t from = offset > alloc_end ? offset : alloc_end;
+        memset(of->tail + (from - alloc_end), 0, end - from);
+    }
+    off_t disk_end = end < alloc_end ? end : alloc_end;
+    if (offset < disk_end) {
+        int first = (offset + block_size - 1) / block_size;
+        int last = disk_end / block_size;
+        if (first < last) {
+            if (punch_blocks(file, &of->map, first, last - first) == -1) return -ENOSPC;
+            zero_range(&of->map, offset, (off_t) first * block_size);
+            zero_range(&of->map, (off_t) last * block_size, disk_end);
+        } else {
+            zero_range(&of->map, offset, disk_end);
+        }
+    }
+    of->generation++;
+    if (dir != NULL) {
+        mark_dirty(dir, of->file_index);
+    }
+    return 0;
+}
+//File space----------------------------------------------------------------------------------------------end->
+//Directory table---------------------------------------------------------------------------------------start->
+//FNV-1a hash of name, or of name.ext when ext is given
+static unsigned hash_name(const char* name, const char* ext) {
+    unsigned h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    }
+    if (ext != NULL) {
+        h = (h ^ '.') * 16777619u;
+        for (; *ext; ext++) {
+            h = (h ^ (unsigned char) *ext) * 16777619u;
+        }
+    }
+    return h;
+}
+
+static void hash_dir(mkfs_dir* dir) {
+    unsigned bucket = hash_name(dir->name, NULL) & (dirs.nbuckets - 1);
+    dir->hash_next = dirs.buckets[bucket];
+    dirs.buckets[bucket] = dir;
+}
+
+static void unhash_dir(mkfs_dir* dir) {
+    mkfs_dir** link = &dirs.buckets[hash_name(dir->name, NULL) & (dirs.nbuckets - 1)];
+    while (*link != dir) {
+        link = &(*link)->hash_next;
+    }
+    *link = dir->hash_next;
+}
+
+//the record of the file in a slot of a directory
+mkfs_file_directory* dir_file(mkfs_dir* dir, int file_index) {
+    return &dir->pages[file_index / FILES_PER_RECORD]->entry.files[file_index % FILES_PER_RECORD];
+}
+
+//where the open file of a slot is kept
+mkfs_open_file** dir_open(mkfs_dir* dir, int file_index) {
+    return &dir->pages[file_index / FILES_PER_RECORD]->open[file_index % FILES_PER_RECORD];
+}
+
+//how many slots a directory has, the ones without a file have an empty fname
+int dir_slots(mkfs_dir* dir) {
+    return dir->npages * FILES_PER_RECORD;
+}
+
+static int* slot_next(mkfs_dir* dir, int file_index) {
+    return &dir->pages[file_index / FILES_PER_RECORD]->next[file_index % FILES_PER_RECORD];
+}
+
+static void hash_file(mkfs_dir* dir, int file_index) {
+    mkfs_file_directory* file = dir_file(dir, file_index);
+    unsigned bucket = hash_name(file->fname, file->fext) & (dir->nbuckets - 1);
+    *slot_next(dir, file_index) = dir->buckets[bucket];
+    dir->buckets[bucket] = file_index;
+}
+
+static void unhash_file(mkfs_dir* dir, int file_index) {
+    mkfs_file_directory* file = dir_file(dir, file_index);
+    int* link = &dir->buckets[hash_name(file->fname, file->fext) & (dir->nbuckets - 1)];
+    while (*link != file_index) {
+        link = slot_next(dir, *link);
+    }
+    *link = *slot_next(dir, file_index);
+}
+
+//builds the hash chains of a directory anew with nbuckets chains
+static void rehash_files(mkfs_dir* dir, int nbuckets) {
+    free(dir->buckets);
+    dir->nbuckets = nbuckets;
+    dir->buckets = malloc(nbuckets * sizeof(int));
+    memset(dir->buckets, -1, nbuckets * sizeof(int));
+    int i;
+    for (i = 0; i < dir_slots(dir); i++) {
+        if (dir_file(dir, i)->fname[0] != 0) hash_file(dir, i);
+    }
+}
+
+static void dirty_page(mkfs_dir_page* page) {
+    if (__atomic_exchange_n(&page->dirty, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_add_fetch(&dirs.ndirty, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+//appends a record to .dir for a page, it is written with the next flush unless it was just read
+static void append_record(mkfs_dir_page* page) {
+    pthread_mutex_lock(&dirs.records_lock);
+    if (dirs.nrecords_used == dirs.records_capacity) {
+        dirs.records_capacity = dirs.records_capacity == 0 ? 64 : dirs.records_capacity * 2;
+        dirs.records = realloc(dirs.records, dirs.records_capacity * sizeof(mkfs_dir_page*));
+    }
+    page->record = dirs.nrecords_used;
+    dirs.records[dirs.nrecords_used++] = page;
+    pthread_mutex_unlock(&dirs.records_lock);
+}
+
+//removes the record of a page from .dir, the last record takes its place. the caller holds dirs.lock for writing
+static void drop_record(mkfs_dir_page* page) {
+    if (page->dirty) __atomic_sub_fetch(&dirs.ndirty, 1, __ATOMIC_ACQ_REL);
+    mkfs_dir_page* last = dirs.records[dirs.nrecords_used - 1];
+    last->record = page->record;
+    dirs.records[page->record] = last;
+    dirs.nrecords_used--;
+    if (last != page) dirty_page(last);
+    free(page);
+}
+
+//gives a directory one more (empty) record, as page number npages
+static mkfs_dir_page* add_page(mkfs_dir* dir) {
+    mkfs_dir_page* page = calloc(1, sizeof(*page));
+    strcpy(page->entry.dname, dir->name);
+    page->entry.nPage = dir->npages;
+    page->dir = dir;
+    dir->pages = realloc(dir->pages, (dir->npages + 1) * sizeof(mkfs_dir_page*));
+    dir->pages[dir->npages++] = page;
+    append_record(page);
+    dirty_page(page);
+    return page;
+}
+
+//appends a directory without records to the table, doubling the hash buckets when they get crowded
+static mkfs_dir* insert_dir(const char* name) {
+    if (dirs.ndirs == dirs.capacity) {
+        dirs.capacity = dirs.capacity == 0 ? 16 : dirs.capacity * 2;
+        dirs.dirs = realloc(dirs.dirs, dirs.capacity * sizeof(mkfs_dir*));
+    }
+    if (dirs.ndirs >= dirs.nbuckets) {
+        int i;
+        free(dirs.buckets);
+        dirs.nbuckets = dirs.nbuckets == 0 ? 64 : dirs.nbuckets * 2;
+        dirs.buckets = calloc(dirs.nbuckets, sizeof(mkfs_dir*));
+        for (i = 0; i < dirs.ndirs; i++) {
+            hash_dir(dirs.dirs[i]);
+        }
+    }
+
+    mkfs_dir* dir = calloc(1, sizeof(*dir));
+    strcpy(dir->name, name);
+    dir->index = dirs.ndirs;
+    pthread_rwlock_init(&dir->lock, NULL);
+    rehash_files(dir, FILE_BUCKETS);
+    dirs.dirs[dirs.ndirs++] = dir;
+    hash_dir(dir);
+    return dir;
+}
+
+//returns the directory called dir_name, or NULL. the caller holds dirs.lock
+mkfs_dir* find_dir(char* dir_name) {
+    if (dirs.nbuckets == 0) return NULL;
+    mkfs_dir* dir = dirs.buckets[hash_name(dir_name, NULL) & (dirs.nbuckets - 1)];
+    while (dir != NULL && strcmp(dir->name, dir_name) != 0) {
+        dir = dir->hash_next;
+    }
+    return dir;
+}
+
+//returns the slot of a file in a directory, or -1. the caller holds dir->lock
+int find_file(mkfs_dir* dir, char* file_target, char* ext_target) {
+    int i = dir->buckets[hash_name(file_target, ext_target) & (dir->nbuckets - 1)];
+    while (i != -1) {
+        mkfs_file_directory* cur_file = dir_file(dir, i);
+        if (strcmp(file_target, cur_file->fname) == 0 && strcmp(ext_target, cur_file->fext) == 0) {
+            return i;
+        }
+        i = *slot_next(dir, i);
+    }
+    return -1;
+}
+
+//marks the record holding a slot for writing back. callable with dir->lock only read locked, concurrent writers
+//to one directory all mark it
+void mark_dirty(mkfs_dir* dir, int file_index) {
+    dirty_page(dir->pages[file_index / FILES_PER_RECORD]);
+}
+
+//creates an empty directory with one record, it is written to .dir with the next flush
+mkfs_dir* add_dir(char* dir_name) {
+    mkfs_dir* dir = insert_dir(dir_name);
+    add_page(dir);
+    return dir;
+}
+
+//removes an empty directory and its records. the caller holds dirs.lock for writing
+void remove_dir(mkfs_dir* dir) {
+    int i;
+    for (i = 0; i < dir->npages; i++) {
+        drop_record(dir->pages[i]);
+    }
+    unhash_dir(dir);
+
+    mkfs_dir* last = dirs.dirs[dirs.ndirs - 1];
+    last->index = dir->index;
+    dirs.dirs[dir->index] = last;
+    dirs.ndirs--;
+    pthread_rwlock_destroy(&dir->lock);
+    free(dir->pages);
+    free(dir->buckets);
+    free(dir);
+}
+
+//adds an empty file to the first free slot of a directory which has fewer than MAX_FILES_IN_DIR files, a new
+//record is added when every record is full. returns its slot
+int add_file(mkfs_dir* dir, char* fname, char* fext) {
+    int p = dir->free_page;
+    while (p < dir->npages && dir->pages[p]->used == FILES_PER_RECORD) p++;
+    mkfs_dir_page* page = p < dir->npages ? dir->pages[p] : add_page(dir);
+    int slot = 0;
+    while (page->entry.files[slot].fname[0] != 0) slot++;
+    if (slot >= page->entry.nFiles) page->entry.nFiles = slot + 1;
+    page->used++;
+    dir->free_page = p;
+    dir->nfiles++;
+
+    int file_index = p * FILES_PER_RECORD + slot;
+    mkfs_file_directory* file = &page->entry.files[slot];
+    memset(file, 0, sizeof(*file));
+    strcpy(file->fname, fname);
+    strcpy(file->fext, fext);
+    file->fsize = 0;
+    file->nExtents = 0;
+    file->nIndirectBlock = -1;
+    if (dir->nfiles > dir->nbuckets) {
+        rehash_files(dir, dir->nbuckets * 2);
+    } else {
+        hash_file(dir, file_index);
+    }
+    mark_dirty(dir, file_index);
+    return file_index;
+}
+
+//frees the slot of a file, no other file moves. if the file is open its record moves into the open file until
+//the last release
+void remove_file(mkfs_dir* dir, int file_index) {
+    int p = file_index / FILES_PER_RECORD;
+    mkfs_dir_page* page = dir->pages[p];
+    mkfs_file_directory* file = dir_file(dir, file_index);
+    mkfs_open_file* of = *dir_open(dir, file_index);
+    if (of != NULL) {
+        of->detached = *file;
+        of->file = &of->detached;
+        __atomic_store_n(&of->dir, NULL, __ATOMIC_RELEASE);
+    }
+
+    unhash_file(dir, file_index);
+    memset(file, 0, sizeof(*file));
+    *dir_open(dir, file_index) = NULL;
+    while (page->entry.nFiles > 0 && page->entry.files[page->entry.nFiles - 1].fname[0] == 0) {
+        page->entry.nFiles--;
+    }
+    page->used--;
+    dir->nfiles--;
+    if (p < dir->free_page) dir->free_page = p;
+    mark_dirty(dir, file_index);
+}
+
+//returns the open file of a file, opening it (and loading its extents) if it is not open yet.
+//the caller holds dir->lock for writing
+mkfs_open_file* open_file(mkfs_dir* dir, int file_index) {
+    mkfs_open_file* of = *dir_open(dir, file_index);
+    if (of == NULL) {
+        of = calloc(1, sizeof(*of));
+        pthread_rwlock_init(&of->lock, NULL);
+        pthread_mutex_init(&of->stream_lock, NULL);
+        of->ra_window = READAHEAD_MIN;
+        of->dir = dir;
+        of->file_index = file_index;
+        of->file = dir_file(dir, file_index);
+        load_extents(of->file, &of->map);
+        of->fallocated = map_blocks(&of->map); //what is still past the end was reserved by fallocate
+        *dir_open(dir, file_index) = of;
+    }
+    __atomic_add_fetch(&of->refs, 1, __ATOMIC_ACQ_REL);
+    return of;
+}
+
+//resolves a path and opens the file, returns NULL if there is no such file
+mkfs_open_file* open_path(const char* path) {
+    char dir_targ[9];
+    char file_targ[9];
+    char ext_targ[4];
+
+    dir_targ[0] = 0;
+    file_targ[0] = 0;
+    ext_targ[0] = 0;
+    parse_path(path, dir_targ, file_targ, ext_targ);
+
+    mkfs_open_file* of = NULL;
+    pthread_rwlock_rdlock(&dirs.lock);
+    mkfs_dir* cur_dir = find_dir(dir_targ);
+    if (cur_dir != NULL) {
+        pthread_rwlock_wrlock(&cur_dir->lock);
+        int file_index = find_file(cur_dir, file_targ, ext_targ);
+        if (file_index != -1) {
+            of = open_file(cur_dir, file_index);
+        }
+        pthread_rwlock_unlock(&cur_dir->lock);
+    }
+    pthread_rwlock_unlock(&dirs.lock);
+    return of;
+}
+
+//drops one handle, the last one frees the open file (and the blocks of an unlinked file)
+void close_file(mkfs_open_file* of) {
+    mkfs_dir* dir;
+    journal_begin();
+    pthread_rwlock_rdlock(&dirs.lock);
+    while (1) { //of->dir only changes (to NULL, on unlink) under the directory lock
+        dir = __atomic_load_n(&of->dir, __ATOMIC_ACQUIRE);
+        if (dir == NULL) break;
+        pthread_rwlock_wrlock(&dir->lock);
+        if (of->dir == dir) break;
+        pthread_rwlock_unlock(&dir->lock);
+    }
+
+    int last = __atomic_sub_fetch(&of->refs, 1, __ATOMIC_ACQ_REL) == 0;
+    if (last && dir != NULL) {
+        //the final size is known now, place the buffered data and give back what was preallocated
+        pthread_rwlock_wrlock(&of->lock);
+        if (flush_tail(of, dir, 0) != 0) { //the buffered data is lost, do not claim it
+            off_t alloc_end = (off_t) map_blocks(&of->map) * block_size;
+            if (of->file->fsize > alloc_end) of->file->fsize = alloc_end;
+            mark_dirty(dir, of->file_index);
+        }
+        trim_file(of, dir);
+        pthread_rwlock_unlock(&of->lock);
+        *dir_open(dir, of->file_index) = NULL;
+    }
+    if (dir != NULL) pthread_rwlock_unlock(&dir->lock);
+    pthread_rwlock_unlock(&dirs.lock);
+
+    if (!last) {
+        journal_end();
+        return;
+    }
+    drop_tail(of);
+    if (dir == NULL) {
+        release_small(of->file);
+        free_map(&of->map);
+    } else {
+        release_extents(&of->map);
+    }
+    pthread_rwlock_destroy(&of->lock);
+    pthread_mutex_destroy(&of->stream_lock);
+    free(of);
+    journal_end();
+}
+
+//read locks the table and the directory of an open file, so its record can be used and changed in place.
+//returns the directory, or NULL (with only the table locked) if the file was unlinked
+mkfs_dir* lock_file_dir(mkfs_open_file* of) {
+    pthread_rwlock_rdlock(&dirs.lock);
+    while (1) {
+        mkfs_dir* dir = __atomic_load_n(&of->dir, __ATOMIC_ACQUIRE);
+        if (dir == NULL) return NULL;
+        pthread_rwlock_rdlock(&dir->lock);
+        if (of->dir == dir) return dir;
+        pthread_rwlock_unlock(&dir->lock);
+    }
+}
+
+void unlock_file_dir(mkfs_dir* dir) {
+    if (dir != NULL) pthread_rwlock_unlock(&dir->lock);
+    pthread_rwlock_unlock(&dirs.lock);
+}
+
+//fills in the header record which .dir starts with
+void dir_header(mkfs_directory_entry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->nPage = DIR_VERSION;
+    entry->nFiles = DIR_MAGIC;
+}
+
+//puts a record behind the other records of its directory as page nPage, growing the directory to it
+static void place_page(mkfs_dir* dir, mkfs_dir_page* page) {
+    if (dir->npages <= page->entry.nPage) {
+        dir->pages = realloc(dir->pages, (page->entry.nPage + 1) * sizeof(mkfs_dir_page*));
+        memset(&dir->pages[dir->npages], 0, (page->entry.nPage + 1 - dir->npages) * sizeof(mkfs_dir_page*));
+        dir->npages = page->entry.nPage + 1;
+    }
+    dir->pages[page->entry.nPage] = page;
+    page->dir = dir;
+    int j;
+    for (j = 0; j < FILES_PER_RECORD; j++) { //slots past nFiles may hold a stale copy of a moved file
+        if (j >= page->entry.nFiles) memset(&page->entry.files[j], 0, sizeof(mkfs_file_directory));
+        if (page->entry.files[j].fname[0] != 0) page->used++;
+    }
+}
+
+//reads every record of .dir into the directory table, behind the header. a directory is made from its records and
+//they are put in it by nPage. a .dir from before extents is converted first, one from before the header has every
+//record moved one further by the next flush, which is one transaction. returns -EINVAL if .dir is of a format this
+//build cannot mount
+int load_dirs() {
+    if (convert_original_dir() != 0) return -EINVAL;
+    touch(".dir"); //just in case it wasn't precreated
+    FILE* f = fopen(".dir", "rb");
+    mkfs_directory_entry entry;
+    int legacy = 0;
+    dirs.header = 0;
+    if (fread(&entry, sizeof(entry), 1, f) == 1) {
+        if (entry.dname[0] == 0 && entry.nFiles == DIR_MAGIC) {
+            if (entry.nPage != DIR_VERSION) {
+                log_error("Cannot mount .dir of version %d, this build knows version %d", entry.nPage, DIR_VERSION);
+                fclose(f);
+                return -EINVAL;
+            }
+            dirs.header = 1;
+        } else {
+            legacy = 1;
+            rewind(f);
+        }
+    }
+    while (fread(&entry, sizeof(entry), 1, f) == 1) {
+        mkfs_dir_page* page = calloc(1, sizeof(*page));
+        page->entry = entry;
+        page->entry.dname[MAX_FILENAME] = 0;
+        if (legacy) { //every directory had one record and these bytes were padding
+            page->entry.unused = 0;
+            page->entry.nPage = 0;
+            int j;
+            for (j = 0; j < FILES_PER_RECORD; j++) {
+                page->entry.files[j].flags = 0;
+            }
+        }
+        append_record(page);
+        if (legacy) dirty_page(page);
+    }
+    fclose(f);
+    dirs.nrecords = dirs.nrecords_used;
+    if (legacy) log_info("Moving the %d records of .dir behind a header", dirs.nrecords);
+
+    int i;
+    for (i = 0; i < dirs.nrecords_used; i++) { //a directory whose first record is lost is still made
+        mkfs_dir_page* page = dirs.records[i];
+        if (find_dir(page->entry.dname) == NULL) insert_dir(page->entry.dname);
+    }
+    for (i = 0; i < dirs.nrecords_used; i++) {
+        mkfs_dir_page* page = dirs.records[i];
+        mkfs_dir* dir = find_dir(page->entry.dname);
+        if (dir->npages <= page->entry.nPage || dir->pages[page->entry.nPage] == NULL) place_page(dir, page);
+    }
+    for (i = 0; i < dirs.nrecords_used; i++) { //a page which was there twice gets a new number
+        mkfs_dir_page* page = dirs.records[i];
+        if (page->dir != NULL) continue;
+        mkfs_dir* dir = find_dir(page->entry.dname);
+        log_warn("Record %d of .dir repeats page %d of %s, it becomes page %d", i, page->entry.nPage, dir->name, dir->npages);
+        page->entry.nPage = dir->npages;
+        place_page(dir, page);
+        dirty_page(page);
+    }
+
+    for (i = 0; i < dirs.ndirs; i++) {
+        mkfs_dir* dir = dirs.dirs[i];
+        int p;
+        for (p = 0; p < dir->npages; p++) {
+            if (dir->pages[p] == NULL) { //a lost record, start it again empty
+                mkfs_dir_page* page = calloc(1, sizeof(*page));
+                strcpy(page->entry.dname, dir->name);
+                page->entry.nPage = p;
+                page->dir = dir;
+                dir->pages[p] = page;
+                append_record(page);
+                dirty_page(page);
+            }
+            dir->nfiles += dir->pages[p]->used;
+        }
+        int nbuckets = FILE_BUCKETS;
+        while (nbuckets < dir->nfiles) nbuckets *= 2;
+        rehash_files(dir, nbuckets);
+    }
+    return 0;
+}
+
+//logs every dirty directory record. every record is copied under its directory's write lock, so no half done
+//change is ever stored
+void flush_dirs() {
+    pthread_mutex_lock(&dirs.flush_lock);
+    pthread_rwlock_rdlock(&dirs.lock);
+    if (__atomic_load_n(&dirs.ndirty, __ATOMIC_ACQUIRE) > 0 || dirs.nrecords != dirs.nrecords_used || !dirs.header) {
+        mkfs_directory_entry entry;
+        if (!dirs.header) {
+            dir_header(&entry);
+            meta_write(TARGET_DIR, &entry, sizeof(entry), 0);
+            dirs.header = 1;
+        }
+        int i = 0;
+        while (1) {
+            //records are only added meanwhile, they can be removed with dirs.lock write locked
+            pthread_mutex_lock(&dirs.records_lock);
+            mkfs_dir_page* page = i < dirs.nrecords_used ? dirs.records[i] : NULL;
+            pthread_mutex_unlock(&dirs.records_lock);
+            if (page == NULL) break;
+            if (__atomic_load_n(&page->dirty, __ATOMIC_ACQUIRE)) {
+                pthread_rwlock_wrlock(&page->dir->lock);
+                entry = page->entry;
+                page->dirty = 0;
+                __atomic_sub_fetch(&dirs.ndirty, 1, __ATOMIC_ACQ_REL);
+                pthread_rwlock_unlock(&page->dir->lock);
+
+                meta_write(TARGET_DIR, &entry, sizeof(entry), (off_t) (i + 1) * sizeof(mkfs_directory_entry));
+            }
+            i++;
+        }
+        if (dirs.nrecords > i) { //drop records of removed directories
+            meta_truncate(TARGET_DIR, (off_t) (i + 1) * sizeof(mkfs_directory_entry));
+        }
+        dirs.nrecords = i;
+    }
+    pthread_rwlock_unlock(&dirs.lock);
+    pthread_mutex_unlock(&dirs.flush_lock);
+}
+
+//writes back what is left and frees the directory table
+void release_dirs() {
+    flush_dirs();
+    int i;
+    for (i = 0; i < dirs.nrecords_used; i++) {
+        free(dirs.records[i]);
+    }
+    for (i = 0; i < dirs.ndirs; i++) {
+        pthread_rwlock_destroy(&dirs.dirs[i]->lock);
+        free(dirs.dirs[i]->pages);
+        free(dirs.dirs[i]->buckets);
+        free(dirs.dirs[i]);
+    }
+    free(dirs.records);
+    free(dirs.dirs);
+    free(dirs.buckets);
+    dirs.records = NULL;
+    dirs.dirs = NULL;
+    dirs.buckets = NULL;
+    dirs.ndirs = dirs.capacity = dirs.nbuckets = dirs.nrecords = dirs.ndirty = 0;
+    dirs.nrecords_used = dirs.records_capacity = dirs.header = 0;
+}
+//Directory table-----------------------------------------------------------------------------------------end->
+
+//Metadata journal--------------------------------------------------------------------------------------start->
+//Every metadata change runs between journal_begin() and journal_end(). A commit waits for the changes in flight,
+//takes a snapshot of the dirty bitmap blocks, directory records and logged indirect blocks as one transaction and
+//lets the changes go on while it does the I/O: data and the previous transaction are synced, the transaction is
+//written to .journal and synced (one sync for every change in it), then it is written in place. At mount the
+//transaction left in .journal is written in place again, so a crash in the middle of that leaves nothing half done.
+
+static uint64_t journal_checksum(const char* buf, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) buf[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+//writes one logged record in place
+static void apply_record(int target, int len, off_t offset, const char* data) {
+    if (target == TARGET_DISK) {
+        image_write(data, len, offset);
+    } else if (len == -1) {
+        ftruncate(journal.dir_fd, offset);
+    } else {
+        pwrite(journal.dir_fd, data, len, offset);
+    }
+}
+
+//opens .journal and writes the transaction it holds in place again, before the bitmap and .dir are loaded
+void init_journal() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP); //commits must not starve
+    pthread_rwlock_init(&journal.barrier, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    journal.fd = open(".journal", O_RDWR | O_CREAT, 0664);
+    journal.dir_fd = open(".dir", O_RDWR | O_CREAT, 0664);
+    journal.seq = journal.started = journal.done = 0;
+
+    struct mkfs_journal_header header;
+    if (pread(journal.fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != JOURNAL_MAGIC) return;
+    journal.seq = header.seq;
+
+    char* buf = malloc(header.len > 0 ? header.len : 1);
+    if (pread(journal.fd, buf, header.len, sizeof(header)) == (ssize_t) header.len
+            && journal_checksum(buf, header.len) == header.checksum) {
+        size_t pos = 0;
+        uint32_t i;
+        for (i = 0; i < header.nrecords; i++) {
+            struct mkfs_journal_record* record = (struct mkfs_journal_record*) (buf + pos);
+            pos += sizeof(*record);
+            apply_record(record->target, record->len, record->offset, buf + pos);
+            if (record->len > 0) pos += record->len;
+        }
+        sync_image();
+        fdatasync(journal.dir_fd);
+        log_info("JOURNAL: Replayed transaction %llu (%u writes)",
+                (unsigned long long) header.seq, header.nrecords);
+    }
+    free(buf);
+}
+
+//adds a write to the transaction being built, replacing an earlier write of the same place
+void meta_write(int target, const void* buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&journal.lock);
+    int i;
+    for (i = journal.npending - 1; i >= 0; i--) {
+        struct mkfs_journal_entry* entry = &journal.pending[i];
+        if (entry->target == target && entry->offset == offset && entry->len == (int) size) {
+            memcpy(entry->data, buf, size);
+            pthread_mutex_unlock(&journal.lock);
+            return;
+        }
+    }
+    if (journal.npending == journal.capacity) {
+        journal.capacity = journal.capacity == 0 ? 16 : journal.capacity * 2;
+        journal.pending = realloc(journal.pending, journal.capacity * sizeof(struct mkfs_journal_entry));
+    }
+    struct mkfs_journal_entry* entry = &journal.pending[journal.npending++];
+    entry->target = target;
+    entry->len = size;
+    entry->offset = offset;
+    entry->data = malloc(size);
+    memcpy(entry->data, buf, size);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+//adds a truncation of the target to the transaction being built
+void meta_truncate(int target, off_t size) {
+    pthread_mutex_lock(&journal.lock);
+    if (journal.npending == journal.capacity) {
+        journal.capacity = journal.capacity == 0 ? 16 : journal.capacity * 2;
+        journal.pending = realloc(journal.pending, journal.capacity * sizeof(struct mkfs_journal_entry));
+    }
+    struct mkfs_journal_entry* entry = &journal.pending[journal.npending++];
+    entry->target = target;
+    entry->len = -1;
+    entry->offset = size;
+    entry->data = NULL;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+//reads metadata of .disk, the newest logged copy wins over what is in place
+ssize_t meta_read(void* buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&journal.lock);
+    struct mkfs_journal_entry* lists[2] = { journal.pending, journal.committing };
+    int counts[2] = { journal.npending, journal.ncommitting };
+    int l;
+    for (l = 0; l < 2; l++) {
+        int i;
+        for (i = counts[l] - 1; i >= 0; i--) {
+            struct mkfs_journal_entry* entry = &lists[l][i];
+            if (entry->target == TARGET_DISK && entry->offset == offset && entry->len == (int) size) {
+                memcpy(buf, entry->data, size);
+                pthread_mutex_unlock(&journal.lock);
+                return size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return image_read(buf, size, offset);
+}
+
+//frees a block which held metadata once the transaction that stops using it is committed,
+//so it cannot be overwritten with data while the committed metadata still points at it
+void free_meta_block(int block) {
+    free_after_commit(block, 1);
+}
+
+//frees num_blocks blocks from start_block once the transaction that stops using them is committed
+void free_after_commit(int start_block, int num_blocks) {
+    pthread_mutex_lock(&journal.lock);
+    if (journal.nfreed == journal.freed_capacity) {
+        journal.freed_capacity = journal.freed_capacity == 0 ? 16 : journal.freed_capacity * 2;
+        journal.freed = realloc(journal.freed, journal.freed_capacity * sizeof(mkfs_extent));
+    }
+    journal.freed[journal.nfreed].nStartBlock = start_block;
+    journal.freed[journal.nfreed].nBlocks = num_blocks;
+    journal.nfreed++;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+//commits now if blocks or packed fragments are waiting for a commit to be freed, so that a full disk gets them
+//back. done is journal.done as the caller saw it before it ran out of space. returns 1 if a retry may find space
+int commit_frees(uint64_t done) {
+    //a commit holds commit_lock until its frees are back, so none is half way while the lists are looked at
+    pthread_mutex_lock(&journal.commit_lock);
+    int committed = journal.done != done;
+    pthread_mutex_lock(&journal.lock);
+    int pending = journal.nfreed > 0;
+    pthread_mutex_unlock(&journal.lock);
+    pthread_mutex_lock(&packed.lock);
+    pending = pending || packed.nfreed > 0;
+    pthread_mutex_unlock(&packed.lock);
+    pthread_mutex_unlock(&journal.commit_lock);
+    if (pending) flush_metadata();
+    return committed || pending;
+}
+
+void journal_begin() {
+    pthread_rwlock_rdlock(&journal.barrier);
+}
+
+void journal_end() {
+    pthread_rwlock_unlock(&journal.barrier);
+}
+
+//logs, syncs and writes in place one transaction
+static void commit_transaction(struct mkfs_journal_entry* entries, int n) {
+    //data and the previous transaction have to be on disk before .journal is overwritten
+    sync_image();
+    fdatasync(journal.dir_fd);
+
+    size_t len = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        len += sizeof(struct mkfs_journal_record) + (entries[i].len > 0 ? entries[i].len : 0);
+    }
+    char* buf = malloc(sizeof(struct mkfs_journal_header) + len);
+    struct mkfs_journal_header* header = (struct mkfs_journal_header*) buf;
+    size_t pos = sizeof(*header);
+    for (i = 0; i < n; i++) {
+        struct mkfs_journal_record* record = (struct mkfs_journal_record*) (buf + pos);
+        record->target = entries[i].target;
+        record->len = entries[i].len;
+        record->offset = entries[i].offset;
+        pos += sizeof(*record);
+        if (entries[i].len > 0) {
+            memcpy(buf + pos, entries[i].data, entries[i].len);
+            pos += entries[i].len;
+        }
+    }
+    header->magic = JOURNAL_MAGIC;
+    header->nrecords = n;
+    header->seq = ++journal.seq;
+    header->len = len;
+    header->checksum = journal_checksum(buf + sizeof(*header), len);
+    pwrite(journal.fd, buf, pos, 0);
+    fdatasync(journal.fd);
+    free(buf);
+
+    //in place, the writes to .disk in batches. a batch ends before a write which overlaps one in it
+    struct mkfs_io ios[RING_BATCH];
+    int nios = 0;
+    for (i = 0; i < n; i++) {
+        if (entries[i].target != TARGET_DISK) {
+            apply_record(entries[i].target, entries[i].len, entries[i].offset, entries[i].data);
+            continue;
+        }
+        int j;
+        for (j = 0; j < nios; j++) {
+            if (entries[i].offset < ios[j].offset + (off_t) ios[j].size && ios[j].offset < entries[i].offset + entries[i].len) break;
+        }
+        if (j < nios || nios == RING_BATCH) {
+            image_rw(ios, nios);
+            nios = 0;
+        }
+        ios[nios++] = (struct mkfs_io) { .buf = entries[i].data, .size = entries[i].len, .offset = entries[i].offset, .write = 1 };
+    }
+    if (nios > 0) image_rw(ios, nios);
+}
+
+//commits every metadata change made so far. a caller whose changes were already taken by a commit which
+//started after it called only waits for that commit (group commit)
+void flush_metadata() {
+    uint64_t ticket = __atomic_load_n(&journal.started, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&journal.commit_lock);
+    if (journal.done > ticket) {
+        pthread_mutex_unlock(&journal.commit_lock);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&journal.barrier);
+    uint64_t number = __atomic_add_fetch(&journal.started, 1, __ATOMIC_ACQ_REL);
+    //the bitmap goes first so that a record never points at blocks which are free on disk
+    flush_bitmap();
+    flush_dirs();
+    pthread_mutex_lock(&journal.lock);
+    journal.committing = journal.pending;
+    journal.ncommitting = journal.npending;
+    journal.pending = NULL;
+    journal.npending = journal.capacity = 0;
+    mkfs_extent* freed = journal.freed;
+    int nfreed = journal.nfreed;
+    journal.freed = NULL;
+    journal.nfreed = journal.freed_capacity = 0;
+    pthread_mutex_unlock(&journal.lock);
+    int nfragments;
+    mkfs_fragment_run* fragments = take_freed_fragments(&nfragments);
+    pthread_rwlock_unlock(&journal.barrier);
+
+    if (journal.ncommitting > 0) {
+        commit_transaction(journal.committing, journal.ncommitting);
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    int i;
+    for (i = 0; i < journal.ncommitting; i++) {
+        free(journal.committing[i].data);
+    }
+    free(journal.committing);
+    journal.committing = NULL;
+    journal.ncommitting = 0;
+    pthread_mutex_unlock(&journal.lock);
+
+    //nothing committed points at them any more, they go out with the next transaction
+    for (i = 0; i < nfreed; i++) {
+        unallocate(freed[i].nStartBlock, freed[i].nBlocks);
+    }
+    free(freed);
+    reuse_fragments(fragments, nfragments);
+    free(fragments);
+
+    __atomic_store_n(&journal.done, number, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&journal.commit_lock);
+}
+
+//commits what is left and empties .journal, so the next mount has nothing to replay
+void close_journal() {
+    flush_metadata();
+    flush_metadata(); //the blocks freed by the last commit
+    sync_image();
+    fdatasync(journal.dir_fd);
+    ftruncate(journal.fd, 0);
+    fdatasync(journal.fd);
+    close(journal.fd);
+    close(journal.dir_fd);
+    journal.fd = journal.dir_fd = -1;
+    pthread_rwlock_destroy(&journal.barrier);
+}
+//Metadata journal----------------------------------------------------------------------------------------end->
+
+//Metadata flusher--------------------------------------------------------------------------------------start->
+//gives blocks to the tails of open files which have been buffered for at least max_age seconds.
+//they stay open, so they get speculative preallocation
+void flush_open_files(int max_age) {
+    time_t now = time(NULL);
+    journal_begin();
+    pthread_rwlock_rdlock(&dirs.lock);
+    int i;
+    for (i = 0; i < dirs.ndirs; i++) {
+        mkfs_dir* dir = dirs.dirs[i];
+        pthread_rwlock_rdlock(&dir->lock);
+        int j;
+        for (j = 0; j < dir_slots(dir); j++) {
+            mkfs_open_file* of = *dir_open(dir, j);
+            if (of == NULL) continue;
+            pthread_rwlock_wrlock(&of->lock);
+            if (of->tail_len > 0 && now - of->tail_since >= max_age) {
+                flush_tail(of, dir, 1);
+            }
+            pthread_rwlock_unlock(&of->lock);
+        }
+        pthread_rwlock_unlock(&dir->lock);
+    }
+    pthread_rwlock_unlock(&dirs.lock);
+    journal_end();
+}
+
+static void* flusher_main(void* arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_INTERVAL;
+        pthread_cond_timedwait(&flusher.wake, &flusher.lock, &deadline);
+        if (flusher.stop) break;
+        pthread_mutex_unlock(&flusher.lock);
+        flush_open_files(DELALLOC_AGE);
+        flush_metadata();
+        pthread_mutex_lock(&flusher.lock);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+//starts writing metadata back every FLUSH_INTERVAL seconds
+void start_flusher() {
+    flusher.stop = 0;
+    pthread_create(&flusher.thread, NULL, flusher_main, NULL);
+}
+
+//asks the flusher for a commit now instead of at the end of its interval
+void kick_flusher() {
+    pthread_mutex_lock(&flusher.lock);
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+}
+
+void stop_flusher() {
+    pthread_mutex_lock(&flusher.lock);
+    flusher.stop = 1;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+    pthread_join(flusher.thread, NULL);
+}
+//Metadata flusher----------------------------------------------------------------------------------------end->
+
+//Defragmenter------------------------------------------------------------------------------------------start->
+//sleeps for ms milliseconds, returns 1 if the defragmenter was stopped meanwhile
+static int defrag_nap(int ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long) (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&defrag.lock);
+    if (!defrag.stop) pthread_cond_timedwait(&defrag.wake, &defrag.lock, &deadline);
+    int stop = defrag.stop;
+    pthread_mutex_unlock(&defrag.lock);
+    return stop;
+}
+
+//how many FUSE calls there have been so far
+static uint64_t foreground_ops() {
+    uint64_t ops = 0;
+    int op;
+    for (op = 0; op < OP_COUNT; op++) {
+        ops += __atomic_load_n(&stats.ops[op].calls, __ATOMIC_RELAXED);
+    }
+    return ops;
+}
+
+//waits until moving moved_bytes keeps to DEFRAG_RATE_KB and the foreground makes fewer than DEFRAG_BUSY_OPS
+//calls per DEFRAG_NAP_MS. returns -1 if the defragmenter was stopped meanwhile
+static int defrag_throttle(uint64_t moved_bytes) {
+    int ms = (int) (moved_bytes * 1000 / ((uint64_t) DEFRAG_RATE_KB * 1024));
+    if (ms > 0 && defrag_nap(ms)) return -1;
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t ops = foreground_ops();
+        double elapsed_ms = (now.tv_sec - defrag.last_check.tv_sec) * 1e3 + (now.tv_nsec - defrag.last_check.tv_nsec) / 1e6;
+        uint64_t busy = ops - defrag.last_ops;
+        defrag.last_ops = ops;
+        defrag.last_check = now;
+        if (busy * DEFRAG_NAP_MS <= DEFRAG_BUSY_OPS * elapsed_ms) return 0;
+        if (defrag_nap(DEFRAG_NAP_MS)) return -1;
+    }
+}
+
+//1 if the run of blocks has free blocks right before and right after it, so moving it away joins two free runs
+static int splits_free_space(int start_block, int num_blocks) {
+    int end = start_block + num_blocks;
+    if (start_block <= 0 || end >= bitmap.nblocks) return 0;
+    return get_state(start_block - 1) == 0 && get_state(end) == 0;
 }
 
-void unset(int i) { //set the bit to 0
-    change_bit(i, -1);
-    return;
+//allocates num_blocks contiguous blocks from the best fitting free run for a file which is moved. returns -1 if
+//there is no such run or if the move would take more than a quarter of the free blocks nobody has reserved
+static int allocate_run(int num_blocks) {
+    pthread_mutex_lock(&bitmap.lock);
+    int start = -1;
+    mkfs_free_extent* x = index_best_fit(num_blocks);
+    if (x != NULL && num_blocks <= (free_index.nfree - free_index.reserved) / 4) {
+        start = x->start;
+        change_range_locked(start, num_blocks, 1);
+    }
+    pthread_mutex_unlock(&bitmap.lock);
+    if (start != -1) {
+        count_event(&stats.allocations, 1);
+        count_event(&stats.blocks_allocated, num_blocks);
+    }
+    return start;
 }
 
-void allocate(int start_block, int num_blocks) {
+//how many runs the blocks of the map which are on disk make, holes between them do not break a run.
+//stores where the first one starts in first
+static int data_runs(mkfs_extent_map* map, int* first) {
+    int runs = 0;
+    int next = -1;
     int i;
-    for (i = start_block; i < start_block + num_blocks; i++) {
-        set(i);
+    *first = -1;
+    for (i = 0; i < map->nExtents; i++) {
+        mkfs_extent* e = &map->extents[i];
+        if (e->nStartBlock == HOLE_BLOCK) continue;
+        int start = disk_start(e->nStartBlock);
+        if (start != next) runs++;
+        if (*first == -1) *first = start;
+        next = start + e->nBlocks;
     }
+    return runs;
 }
 
-void unallocate(int start_block, int num_blocks) {
+//copies every block of the map which is on disk, in file order, to the blocks starting at start_block. unwritten
+//blocks keep their place in the run but are not copied
+static int copy_to_run(mkfs_extent_map* map, int start_block) {
+    size_t chunk = (size_t) DEFRAG_CHUNK_KB * 1024;
+    char* buf = malloc(chunk);
+    off_t dst = (off_t) start_block * block_size;
+    int res = 0;
     int i;
-    printf("--------------------------------------------------------------------->Unallocating %d starting at %d\n", num_blocks, start_block);
-    for (i = start_block; i < start_block + num_blocks; i++) {
-        unset(i);
+    for (i = 0; i < map->nExtents && res == 0; i++) {
+        if (map->extents[i].nStartBlock == HOLE_BLOCK) continue;
+        if (map->extents[i].nStartBlock < HOLE_BLOCK) {
+            dst += (off_t) map->extents[i].nBlocks * block_size;
+            continue;
+        }
+        off_t pos = (off_t) (map->ends[i] - map->extents[i].nBlocks) * block_size;
+        off_t end = (off_t) map->ends[i] * block_size;
+        for (; pos < end && res == 0; pos += chunk) {
+            size_t len = end - pos < chunk ? end - pos : chunk;
+            if (io_extents(map, buf, len, pos, 0) != (int) len || image_write(buf, len, dst) != (ssize_t) len) {
+                res = -1;
+            }
+            dst += len;
+        }
     }
+    free(buf);
+    return res;
 }
 
-//just for test
-void print_bitmap() {
-    printf("---------------------------------------------------------------------start->print_bitmap\n");
-    int i = 0;
-    touch(".disk"); //just in case it wasn't precreated
-    int size = last_bitmap_index(); //get the number of blocks in bitmap
-    for (i = 0; i <= size; i++) { //for each byte in each block
-        int this_bit = get_state(i);
-        printf("%u", this_bit); 
-        if (i % 20 == 19) {
-            printf("\n");
+//moves the blocks of the file at path into one run if they are in more than one or if they split free space.
+//holes stay holes and unwritten blocks stay unwritten. returns how many blocks were moved
+static int defrag_file(const char* path) {
+    mkfs_open_file* of = open_path(path);
+    if (of == NULL) return 0;
+
+    //copy with the file read locked: it can still be read but not written. the directory is let go meanwhile
+    mkfs_dir* dir = lock_file_dir(of);
+    pthread_rwlock_rdlock(&of->lock);
+    unlock_file_dir(dir);
+    int nblocks = data_blocks(&of->map);
+    int old_start;
+    int runs = data_runs(&of->map, &old_start);
+    uint64_t generation = of->generation;
+    int start = -1;
+    if (dir != NULL && of->tail_len == 0 && nblocks > 0
+            && (runs > 1 || (runs == 1 && splits_free_space(old_start, nblocks)))) {
+        start = allocate_run(nblocks);
+        //right behind itself it would split the free space again once its old blocks are freed
+        if (start != -1 && runs == 1 && start == old_start + nblocks) {
+            unallocate(start, nblocks);
+            start = -1;
         }
-        if (i % 512 == 511) {
-            printf("\n");
+        if (start != -1 && copy_to_run(&of->map, start) != 0) {
+            unallocate(start, nblocks);
+            start = -1;
         }
     }
-    printf("-----------------------------------------------------------------------end->print_bitmap\n");
-    return;
-}
+    pthread_rwlock_unlock(&of->lock);
+    if (start == -1) {
+        close_file(of);
+        return 0;
+    }
 
-//makes the bitmap if it doesnt exist
-void check_bitmap() {
-    touch(".disk"); //just in case it wasn't precreated
-    FILE* f = fopen(".disk", "r+b");
-    char first_char = 0;
-    fseek(f, 0, SEEK_SET);
-    fread(&first_char, sizeof(char), 1, f);
-    if (first_char == 0) { //then the beginning of the bitmap is zero and thus the bitmap does not exist
-        int bitmap_size = get_bitmap_size();
-        int i = 0;
-        printf("--------------------------------------------------------------------->Creating new bitmap of size %d\n", bitmap_size);
-        for (i = 0; i < bitmap_size; i++) {
-            set(i);
+    //switch the file over to the copy in one transaction, unless it was written or unlinked meanwhile.
+    //the old blocks are only reused once the new extents are committed
+    int moved = 0;
+    journal_begin();
+    dir = lock_file_dir(of);
+    pthread_rwlock_wrlock(&of->lock);
+    if (dir != NULL && of->generation == generation && of->tail_len == 0 && data_blocks(&of->map) == nblocks) {
+        int n = of->map.nExtents;
+        mkfs_extent* old = malloc(n * sizeof(mkfs_extent));
+        memcpy(old, of->map.extents, n * sizeof(mkfs_extent));
+        of->map.nExtents = 0;
+        int next = start;
+        int i;
+        for (i = 0; i < n; i++) {
+            if (old[i].nStartBlock == HOLE_BLOCK) {
+                push_extent(&of->map, HOLE_BLOCK, old[i].nBlocks);
+            } else {
+                free_after_commit(disk_start(old[i].nStartBlock), old[i].nBlocks);
+                push_extent(&of->map, old[i].nStartBlock < HOLE_BLOCK ? UNWRITTEN_BLOCK(next) : next, old[i].nBlocks);
+                next += old[i].nBlocks;
+            }
         }
-        // print_bitmap();
+        free(old);
+        of->map.dirty_from = 0;
+        store_extents(of->file, &of->map);
+        of->generation++;
+        mark_dirty(dir, of->file_index);
+        moved = nblocks;
     }
-    fclose(f);
-    return;
+    pthread_rwlock_unlock(&of->lock);
+    unlock_file_dir(dir);
+    journal_end();
+    if (moved == 0) unallocate(start, nblocks);
+
+    close_file(of);
+    return moved;
 }
 
-//finds contiguous free blocks
-int find_free_space(int num_blocks) {
-    int run_start = -1;
-    int run_length = 0;
-    int cur_block = 0;
+//moves every fragmented file into one extent and every file which splits free space out of the way.
+//throttled passes keep to DEFRAG_RATE_KB and wait for the foreground to quiet down. returns how many files moved
+int defrag_pass(int throttled) {
+    pthread_mutex_lock(&defrag.pass_lock);
 
-    while (cur_block <= last_bitmap_index()) {
-        int this_bit = get_state(cur_block);
-        if (this_bit == 0) {
-            if (run_start == -1) {
-                run_start = cur_block;
+    //the candidates, by path so that they are looked up again when it is their turn
+    char (*paths)[MAX_FILENAME * 2 + MAX_EXTENSION + 4] = NULL;
+    int npaths = 0;
+    int capacity = 0;
+    pthread_rwlock_rdlock(&dirs.lock);
+    int i;
+    for (i = 0; i < dirs.ndirs; i++) {
+        mkfs_dir* dir = dirs.dirs[i];
+        pthread_rwlock_rdlock(&dir->lock);
+        int j;
+        for (j = 0; j < dir_slots(dir); j++) {
+            mkfs_file_directory* file = dir_file(dir, j);
+            mkfs_open_file* of = *dir_open(dir, j);
+            if (of != NULL) pthread_rwlock_rdlock(&of->lock); //an open file may get new extents right now
+            int candidate = file->fname[0] != 0 && file->nExtents > 0 && (file->nExtents > 1
+                    || splits_free_space(disk_start(file->extents[0].nStartBlock), file->extents[0].nBlocks));
+            if (of != NULL) pthread_rwlock_unlock(&of->lock);
+            if (!candidate) continue;
+            if (npaths == capacity) {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                paths = realloc(paths, capacity * sizeof(*paths));
             }
-            run_length++;
-            if (run_length >= num_blocks) {
-                last_allocation_start = run_start;
-                return run_start;
+            sprintf(paths[npaths++], "/%s/%s%s%s", dir->name, file->fname, file->fext[0] != 0 ? "." : "", file->fext);
+        }
+        pthread_rwlock_unlock(&dir->lock);
+    }
+    pthread_rwlock_unlock(&dirs.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &defrag.last_check);
+    defrag.last_ops = foreground_ops();
+    int files = 0;
+    uint64_t moved_bytes = 0;
+    for (i = 0; i < npaths; i++) {
+        if (throttled ? defrag_throttle(moved_bytes) != 0 : __atomic_load_n(&defrag.stop, __ATOMIC_ACQUIRE)) break;
+        int moved = defrag_file(paths[i]);
+        if (moved > 0) {
+            files++;
+            count_event(&stats.defrag_files, 1);
+            count_event(&stats.defrag_blocks, moved);
+        }
+        moved_bytes = (uint64_t) moved * block_size;
+    }
+    free(paths);
+    __atomic_add_fetch(&defrag.passes, 1, __ATOMIC_RELAXED);
+    log_info("DEFRAG: Moved %d of %d candidate files, %d free runs, largest %d blocks", files, npaths,
+            free_index.nextents, free_largest_run());
+
+    pthread_mutex_unlock(&defrag.pass_lock);
+    return files;
+}
+
+static void* defrag_main(void* arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&defrag.lock);
+    while (!defrag.stop) {
+        if (!defrag.requested) {
+            int res = 0;
+            if (options.defrag_interval > 0) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += options.defrag_interval;
+                res = pthread_cond_timedwait(&defrag.wake, &defrag.lock, &deadline);
+            } else {
+                pthread_cond_wait(&defrag.wake, &defrag.lock);
             }
-        } else if (this_bit == 1) {
-            run_length = 0;
-            run_start = -1;
+            if (res != ETIMEDOUT && !defrag.requested) continue;
         }
-        cur_block++;
+        if (defrag.stop) break;
+        defrag.requested = 0;
+        pthread_mutex_unlock(&defrag.lock);
+        defrag_pass(1);
+        pthread_mutex_lock(&defrag.lock);
     }
-    return -1;
+    pthread_mutex_unlock(&defrag.lock);
+    return NULL;
+}
+
+//starts a defragmenter pass every defrag_interval seconds (mount option defrag=) and whenever one is requested
+void start_defrag() {
+    defrag.stop = 0;
+    defrag.requested = 0;
+    pthread_create(&defrag.thread, NULL, defrag_main, NULL);
+}
+
+//asks for a pass now, for a write to DEFRAG_PATH
+void request_defrag() {
+    pthread_mutex_lock(&defrag.lock);
+    defrag.requested = 1;
+    pthread_cond_broadcast(&defrag.wake);
+    pthread_mutex_unlock(&defrag.lock);
 }
+
+//stops the thread, a pass which is running ends after the file it is moving
+void stop_defrag() {
+    pthread_mutex_lock(&defrag.lock);
+    __atomic_store_n(&defrag.stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&defrag.wake);
+    pthread_mutex_unlock(&defrag.lock);
+    pthread_join(defrag.thread, NULL);
+}
+
+//writes what the defragmenter did and how fragmented the free space is as text into buf
+size_t render_defrag(char* buf, size_t size) {
+    pthread_mutex_lock(&bitmap.lock);
+    int nfree = free_index.nfree;
+    int runs = free_index.nextents;
+    pthread_mutex_unlock(&bitmap.lock);
+    int largest = free_largest_run();
+    int len = snprintf(buf, size, "passes=%llu files_moved=%llu blocks_moved=%llu free_blocks=%d free_runs=%d "
+            "largest_free_run=%d interval=%d\n", (unsigned long long) __atomic_load_n(&defrag.passes, __ATOMIC_RELAXED),
+            (unsigned long long) __atomic_load_n(&stats.defrag_files, __ATOMIC_RELAXED),
+            (unsigned long long) __atomic_load_n(&stats.defrag_blocks, __ATOMIC_RELAXED), nfree, runs, largest,
+            options.defrag_interval);
+    return len < (int) size ? len : size - 1;
+}
+//Defragmenter--------------------------------------------------------------------------------------------end->
 //Implementation main functions--------------------------------------------------------------------------------end->
 
 static void *_init(struct fuse_conn_info * conn) {
-    printf("--------------------------------------------------------------------->MAX_FILES_IN_DIR = %d\n", MAX_FILES_IN_DIR);
-    printf("--------------------------------------------------------------------->Filesystem has been initialized!\n");
+    memset(&stats, 0, sizeof(stats));
+    start_logging();
+    log_debug("MAX_FILES_IN_DIR = %d", (int) (MAX_FILES_IN_DIR));
+    if (open_image() != 0) {
+        log_error("Cannot open .disk");
+        stop_logging();
+        exit(1);
+    }
+    if (conn != NULL) {
+        //splicing moves data between /dev/fuse and .disk at any offset, which O_DIRECT does not take and which a
+        //striped volume would have to cut at its stripe units
+        int splice = !image.spliceable ? 0 : FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+        conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | splice);
+        splice_read = (conn->want & FUSE_CAP_SPLICE_READ) != 0;
+        splice_write = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+    }
+    log_info("Opened .disk%s", image.direct ? " with O_DIRECT" : "");
+    if (image.nmembers > 1) {
+        log_info("Striped over %d members in units of %lld KiB", image.nmembers, (long long) image.stripe_unit / 1024);
+    }
+    init_journal();
+    if (load_superblock() != 0) {
+        stop_logging();
+        exit(1);
+    }
+    init_cache(options.cache_kb);
+    load_bitmap();
+    check_bitmap();
+    if (load_dirs() != 0) {
+        stop_logging();
+        exit(1);
+    }
+    load_packed();
+    start_flusher();
+    start_defrag();
+    log_info("Loaded bitmap of %d blocks of %d bytes and %d directories", bitmap.nblocks, block_size, dirs.ndirs);
+    log_info("Filesystem has been initialized!");
     return NULL;
 }
 
 static void _destroy(void *a) {
-    printf("--------------------------------------------------------------------->Filesystem has been destroyed!\n");
+    stop_defrag();
+    stop_flusher();
+    flush_open_files(0);
+    dump_stats();
+    close_journal();
+    release_cache();
+    release_bitmap();
+    release_dirs();
+    release_packed();
+    close_image();
+    log_info("Filesystem has been destroyed!");
+    stop_logging();
+}
+
+//renders the virtual file at path (STATS_PATH or DEFRAG_PATH) into a buffer the caller frees and sets len to its
+//length. returns NULL if path is no virtual file
+static char* render_virtual(const char* path, size_t* len) {
+    char* text;
+    if (strcmp(path, STATS_PATH) == 0) {
+        text = malloc(STATS_TEXT);
+        *len = render_stats(text, STATS_TEXT);
+    } else if (strcmp(path, DEFRAG_PATH) == 0) {
+        text = malloc(STATS_TEXT);
+        *len = render_defrag(text, STATS_TEXT);
+    } else {
+        return NULL;
+    }
+    return text;
+}
+
+//fills the attributes of a directory
+static void dir_stat(struct stat* st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_nlink = 2;
+    st->st_mode = S_IFDIR | 0755;
+}
+
+//fills the attributes of the file in a slot of dir from its record, the caller holds the directory lock
+static void file_stat(mkfs_dir* dir, int file_index, struct stat* st) {
+    mkfs_file_directory* file = dir_file(dir, file_index);
+    mkfs_open_file* of = *dir_open(dir, file_index);
+    if (of != NULL) pthread_rwlock_rdlock(&of->lock); //an open file may be written right now
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | 0666;
+    st->st_nlink = 1;
+    st->st_size = file->fsize;
+    st->st_blksize = block_size;
+    st->st_blocks = stat_blocks(file, of);
+    if (of != NULL) pthread_rwlock_unlock(&of->lock);
+}
+
+//readdir cursor of a directory in the root, its name read as a big-endian number. names are ASCII, so it is
+//positive and above the cursors of "." and ".."
+static off_t dir_cursor(const char* name) {
+    off_t cursor = 0;
+    int i;
+    for (i = 0; i < MAX_FILENAME; i++) {
+        cursor = (cursor << 8) | (unsigned char) name[i];
+        if (name[i] == 0) {
+            cursor <<= 8 * (MAX_FILENAME - 1 - i);
+            break;
+        }
+    }
+    return cursor;
+}
+
+static int compare_dirs(const void* a, const void* b) {
+    off_t x = dir_cursor((*(mkfs_dir* const*) a)->name);
+    off_t y = dir_cursor((*(mkfs_dir* const*) b)->name);
+    return x < y ? -1 : x > y;
 }
 
 static int _getattr(const char *path, struct stat * stbuf) {
-    printf("--------------------------------------------------------------------->GETATTR: %s\n", path);
+    log_trace("GETATTR: %s", path);
 
     int res = 0;
     memset(stbuf, 0, sizeof(struct stat));
 
-    touch(".dir"); //just in case it wasn't precreated
-
-    FILE* f = fopen(".dir", "r");
-
     char dir_target[9];
     char file_target[9];
     char ext_target[4];
@@ -331,88 +5217,99 @@ static int _getattr(const char *path, struct stat * stbuf) {
     ext_target[0] = 0;
     parse_path(path, dir_target, file_target, ext_target);
 
-    struct mkfs_directory_entry cur_dir;
-    fread(&cur_dir, sizeof(cur_dir), 1, f);
-    
-    while (strcmp(cur_dir.dname, dir_target) != 0 && !feof(f)) {
-        int read = fread(&cur_dir, sizeof(cur_dir), 1, f);
-        if (read == 0) break;
+    if (strcmp(path, "/") == 0) {
+        dir_stat(stbuf);
+        return 0;
     }
-    fclose(f);
 
-    if (strcmp(cur_dir.dname, dir_target) == 0 || strcmp(path, "/") == 0) {
-        //if we are looking for directory attributes
-        if (strlen(file_target) == 0) {
-            stbuf->st_nlink = 2;
-            stbuf->st_mode = S_IFDIR | 0755;
-        } else { //if we are looking for a file which is there
-            int file_index = find_file(&cur_dir, file_target, ext_target);
-
-            if (file_index == -1) {
-                res = -ENOENT;
-            } else { //if we found file
-                stbuf->st_mode = S_IFREG | 0666;
-                stbuf->st_nlink = 1;
-                stbuf->st_size = cur_dir.files[file_index].fsize;
-                stbuf->st_blksize = 512;
-                stbuf->st_blocks = cur_dir.files[file_index].fsize / 512;
-                if (cur_dir.files[file_index].fsize % 512 != 0) {
-                    stbuf->st_blocks++;
-                }
-            }
-        }
-    } else {
+    size_t len;
+    char* text = render_virtual(path, &len);
+    if (text != NULL) { //the size is what a read would return right now
+        stbuf->st_mode = S_IFREG | (strcmp(path, DEFRAG_PATH) == 0 ? 0644 : 0444);
+        stbuf->st_nlink = 1;
+        stbuf->st_size = len;
+        free(text);
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&dirs.lock);
+    mkfs_dir* cur_dir = find_dir(dir_target);
+    if (cur_dir != NULL) pthread_rwlock_rdlock(&cur_dir->lock);
+    if (cur_dir == NULL) {
         res = -ENOENT;
+    } else if (strlen(file_target) == 0) { //if we are looking for directory attributes
+        dir_stat(stbuf);
+    } else { //if we are looking for a file which is there
+        int file_index = find_file(cur_dir, file_target, ext_target);
+
+        if (file_index == -1) {
+            res = -ENOENT;
+        } else { //if we found file
+            file_stat(cur_dir, file_index, stbuf);
+        }
     }
+    if (cur_dir != NULL) pthread_rwlock_unlock(&cur_dir->lock);
+    pthread_rwlock_unlock(&dirs.lock);
     return res;
 }
 
+//lists a directory from offset on, where "." is 0 and ".." is 1. a directory in the root is at its dir_cursor and a
+//file at its slot + 3, neither moves when other entries are removed, so a listing resumes where the last filler
+//call stopped
 static int _readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info * fi) {
-    printf("--------------------------------------------------------------------->READDIR: %s\n", path);
-    
-    (void) offset;
+    log_trace("READDIR: %s", path);
+
     (void) fi;
 
-    touch(".dir"); //just in case it wasn't precreated
+    int i;
+    struct stat st;
 
-    FILE* f = fopen(".dir", "r");
-    struct mkfs_directory_entry cur_dir;
+    pthread_rwlock_rdlock(&dirs.lock);
+    mkfs_dir* cur_dir = strcmp(path, "/") == 0 ? NULL : find_dir((char*) path + 1);
+    if (strcmp(path, "/") != 0 && cur_dir == NULL) {
+        pthread_rwlock_unlock(&dirs.lock);
+        return -ENOENT;
+    }
+    dir_stat(&st);
+    if ((offset < 1 && filler(buf, ".", &st, 1)) || (offset < 2 && filler(buf, "..", &st, 2))) {
+        pthread_rwlock_unlock(&dirs.lock);
+        return 0;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        while (fread(&cur_dir, sizeof(cur_dir), 1, f) > 0 && !feof(f)) {
-            filler(buf, cur_dir.dname, NULL, 0);
+    if (cur_dir == NULL) { //the root lists directories in dir_cursor order
+        mkfs_dir** sorted = malloc((dirs.ndirs + 1) * sizeof(mkfs_dir*));
+        int n = 0;
+        for (i = 0; i < dirs.ndirs; i++) {
+            if (dir_cursor(dirs.dirs[i]->name) >= offset) sorted[n++] = dirs.dirs[i];
         }
+        qsort(sorted, n, sizeof(mkfs_dir*), compare_dirs);
+        for (i = 0; i < n; i++) {
+            if (filler(buf, sorted[i]->name, &st, dir_cursor(sorted[i]->name) + 1)) break;
+        }
+        free(sorted);
     } else {
-        int found = 0;
-        while (fread(&cur_dir, sizeof(cur_dir), 1, f) > 0 && !feof(f)) {
-            if (strcmp(cur_dir.dname, path + 1) == 0) {
-                int i;
-                for (i = 0; i < cur_dir.nFiles; i++) {
-                    char full_name[13];
-                    full_name[0] = 0;
-                    strcat(full_name, cur_dir.files[i].fname);
-                    if (strlen(cur_dir.files[i].fext) > 0) {
-                        strcat(full_name, ".");
-                    }
-                    strcat(full_name, cur_dir.files[i].fext);
-                    filler(buf, full_name, NULL, 0);
-                }
-                found = 1;
-            }
-        }
-        if (!found) {
-            fclose(f);
-            return -ENOENT;
+        pthread_rwlock_rdlock(&cur_dir->lock);
+        for (i = offset > 3 ? offset - 3 : 0; i < dir_slots(cur_dir); i++) {
+            mkfs_file_directory* file = dir_file(cur_dir, i);
+            if (file->fname[0] == 0) continue; //a free slot
+            char full_name[13];
+            full_name[0] = 0;
+            strcat(full_name, file->fname);
+            if (strlen(file->fext) > 0) {
+                strcat(full_name, ".");
+            }
+            strcat(full_name, file->fext);
+            file_stat(cur_dir, i, &st);
+            if (filler(buf, full_name, &st, i + 4)) break;
         }
+        pthread_rwlock_unlock(&cur_dir->lock);
     }
-    fclose(f);
+    pthread_rwlock_unlock(&dirs.lock);
     return 0;
 }
 
 static int _mkdir(const char *path, mode_t mode) {
-    printf("--------------------------------------------------------------------->MKDIR: %s\n", path);
+    log_trace("MKDIR: %s", path);
 
     char dir_target[9];
     char file_target[9];
@@ -424,30 +5321,23 @@ static int _mkdir(const char *path, mode_t mode) {
 
     if (strlen(dir_target) > 9) return -ENAMETOOLONG;
     if (strlen(file_target) > 0) return -EPERM;
-    
-    touch(".dir"); //just in case it wasn't precreated
-
-    FILE* g = fopen(".dir", "r");
-    struct mkfs_directory_entry cur_dir;
-    
-    fread(&cur_dir, sizeof(cur_dir), 1, g);
-    while (strcmp(cur_dir.dname, path + 1) != 0 && fread(&cur_dir, sizeof(cur_dir), 1, g) > 0);
-    fclose(g);
-
-    if (strcmp(cur_dir.dname, path + 1) == 0) return -EEXIST;
-    
-    FILE* f = fopen(".dir", "a");
-    struct mkfs_directory_entry next_dir;
-    strcpy(next_dir.dname, path + 1);
-    next_dir.nFiles = 0;
+    if (strcmp(path, STATS_PATH) == 0 || strcmp(path, DEFRAG_PATH) == 0) return -EEXIST;
 
-    fwrite(&next_dir, sizeof(next_dir),  1, f);
-    fclose(f);
-    return 0;
+    int res = 0;
+    journal_begin();
+    pthread_rwlock_wrlock(&dirs.lock);
+    if (find_dir((char*) path + 1) != NULL) {
+        res = -EEXIST;
+    } else {
+        add_dir((char*) path + 1);
+    }
+    pthread_rwlock_unlock(&dirs.lock);
+    journal_end();
+    return res;
 }
 
 static int _rmdir(const char *path) {
-    printf("--------------------------------------------------------------------->RMDIR: %s\n", path);
+    log_trace("RMDIR: %s", path);
 
     char dir_target[9];
     char file_target[9];
@@ -459,40 +5349,24 @@ static int _rmdir(const char *path) {
     
     if (strlen(file_target) > 0) return -ENOTDIR;
 
-    touch(".dir"); //just in case it wasn't precreated
-
-    FILE* f = fopen(".dir", "r+b");
-
-    fseek(f, -sizeof(mkfs_directory_entry), SEEK_END);
-    int length = ftell(f);
-    struct mkfs_directory_entry temp_entry;
-    fread(&temp_entry, sizeof(temp_entry), 1, f);
-
-    //find the one to delete
-    fseek(f, 0, SEEK_SET); //go to begin
-    struct mkfs_directory_entry cur_dir;
-    fread(&cur_dir, sizeof(cur_dir), 1, f);
-   
-    //look for deletion target
-    while (strcmp(cur_dir.dname, path + 1) != 0 && !feof(f)) {
-        fread(&cur_dir, sizeof(cur_dir), 1, f);
-    }
-
-    //if we found deletion target, overwrite it with last element
-    if (strcmp(cur_dir.dname, path + 1) == 0) {
-        fseek(f, -sizeof(cur_dir), SEEK_CUR);
-        fwrite(&temp_entry, sizeof(cur_dir), 1, f);
-        fseek(f, 0, SEEK_SET);
+    int res = 0;
+    journal_begin();
+    pthread_rwlock_wrlock(&dirs.lock); //nobody else holds a directory lock now
+    mkfs_dir* cur_dir = find_dir((char*) path + 1);
+    if (cur_dir == NULL) {
+        res = -ENOENT;
+    } else if (cur_dir->nfiles > 0) {
+        res = -ENOTEMPTY;
     } else {
-        fclose(f);
-        return -ENOENT;
+        remove_dir(cur_dir);
     }
-    fclose(f);
-    return 0;
+    pthread_rwlock_unlock(&dirs.lock);
+    journal_end();
+    return res;
 }
 
 static int _mknod(const char *path, mode_t mode, dev_t dev) {
-    printf("--------------------------------------------------------------------->MKNOD: %s\n", path);
+    log_trace("MKNOD: %s", path);
 
     (void) mode;
     (void) dev;
@@ -506,45 +5380,33 @@ static int _mknod(const char *path, mode_t mode, dev_t dev) {
     dir_targ[0] = 0;
     parse_path(path, dir_targ, file_targ, ext_targ);
 
-    check_bitmap();
-
     if (strlen(file_targ) > 8 || strlen(ext_targ) > 3 ) return -ENAMETOOLONG;
     if (strlen(file_targ) == 0) return -EPERM; //if we are trying to create a file in root, parse path returns null for file and ext strings
 
+    int res = 0;
+    journal_begin();
+    pthread_rwlock_rdlock(&dirs.lock);
 
-    mkfs_directory_entry cur_dir;
-    
     //find directory, make sure it exists
-    int dir_idx = find_dir(&cur_dir, dir_targ);
-    if (dir_idx == -1) return -ENOENT;
-    
-    //make sure file does not exist
-    int file_idx = find_file(&cur_dir, file_targ, ext_targ);
-    if (file_idx != -1) return -EEXIST;
-
-    //make the file
-    int new_file_idx = cur_dir.nFiles;
-    if (new_file_idx > MAX_FILES_IN_DIR) return -EPERM; //if the directory is full return a permission error
-
-    strcpy(cur_dir.files[new_file_idx].fname, file_targ);
-    strcpy(cur_dir.files[new_file_idx].fext, ext_targ);
-    cur_dir.files[new_file_idx].fsize = 0;
-
-    int new_file_block = -1;
-    cur_dir.files[new_file_idx].nStartBlock = new_file_block;
-
-    cur_dir.nFiles++;
-
-    FILE* f = fopen(".dir", "r+b");
-    fseek(f, dir_idx, SEEK_SET);
-    fwrite(&cur_dir, sizeof(cur_dir), 1, f);
-
-    fclose(f);
-    return 0;
+    mkfs_dir* cur_dir = find_dir(dir_targ);
+    if (cur_dir != NULL) pthread_rwlock_wrlock(&cur_dir->lock);
+    if (cur_dir == NULL) {
+        res = -ENOENT;
+    } else if (find_file(cur_dir, file_targ, ext_targ) != -1) { //make sure file does not exist
+        res = -EEXIST;
+    } else if (cur_dir->nfiles >= MAX_FILES_IN_DIR) { //if the directory is full return a permission error
+        res = -EPERM;
+    } else { //make the file
+        add_file(cur_dir, file_targ, ext_targ);
+    }
+    if (cur_dir != NULL) pthread_rwlock_unlock(&cur_dir->lock);
+    pthread_rwlock_unlock(&dirs.lock);
+    journal_end();
+    return res;
 }
 
 static int _unlink(const char *path) {
-    printf("--------------------------------------------------------------------->UNLINK: %s\n", path);
+    log_trace("UNLINK: %s", path);
 
     char dir_target[9];
     char file_target[9];
@@ -559,208 +5421,390 @@ static int _unlink(const char *path) {
         return -EISDIR;
     }
 
-    struct stat stbuf;
-    int attr = _getattr(path, &stbuf);
-    if (attr != 0) {
-        return attr;
+    int res = 0;
+    journal_begin();
+    pthread_rwlock_rdlock(&dirs.lock);
+    mkfs_dir* cur_dir = find_dir(dir_target);
+    if (cur_dir != NULL) pthread_rwlock_wrlock(&cur_dir->lock);
+    int file_index = cur_dir == NULL ? -1 : find_file(cur_dir, file_target, ext_target);
+    if (file_index == -1) {
+        res = -ENOENT;
+    } else {
+        mkfs_file_directory* the_file = dir_file(cur_dir, file_index);
+        if (the_file->nExtents != 0 && *dir_open(cur_dir, file_index) == NULL) { //open files are freed on the last release
+            log_debug("UNLINK: Deleting a file (%s) of size %zu", the_file->fname, the_file->fsize);
+            free_file(the_file); //free the blocks it used
+        }
+
+        //removing all references to it in the directory table
+        remove_file(cur_dir, file_index);
     }
-    
-    mkfs_directory_entry dir_struct;
-    int dir_idx = find_dir(&dir_struct, dir_target);
+    if (cur_dir != NULL) pthread_rwlock_unlock(&cur_dir->lock);
+    pthread_rwlock_unlock(&dirs.lock);
+    journal_end();
+    return res;
+}
 
-    if (dir_idx == -1) {
-        return -ENOENT;
+static int _read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info * fi) {
+    log_trace("READ: %s", path);
+
+    size_t len;
+    char* text = render_virtual(path, &len);
+    if (text != NULL) { //rendered anew for every read
+        int n = offset >= len ? 0 : (len - offset < size ? len - offset : size);
+        memcpy(buf, text + offset, n);
+        free(text);
+        return n;
     }
-    
-    int file_index = find_file(&dir_struct, file_target, ext_target);
-    mkfs_file_directory the_file = dir_struct.files[file_index];
-    
-    if (the_file.fsize > 0) {
-        printf("--------------------------------------------------------------------->UNLINK: Deleting a file (%s) of size %d\n", the_file.fname, the_file.fsize);
-        int num_blocks = the_file.fsize / 512;
-        if (the_file.fsize % 512 != 0) {
-            num_blocks++;
-        }
-        unallocate(the_file.nStartBlock, num_blocks); //free the blocks it used
+
+    //the handle from _open, only resolve the path when there is none
+    mkfs_open_file* of = fi != NULL ? (mkfs_open_file*) (uintptr_t) fi->fh : NULL;
+    int opened_here = of == NULL;
+    if (opened_here) {
+        of = open_path(path);
+        if (of == NULL) return -ENOENT;
     }
 
-    //removing all references to it in the .dir file
-    dir_struct.files[file_index] = dir_struct.files[dir_struct.nFiles - 1];
-    dir_struct.nFiles--;
+    mkfs_dir* cur_dir = lock_file_dir(of);
+    pthread_rwlock_rdlock(&of->lock);
+    int bytes_read = 0;
+    if (size > 0 && offset < of->file->fsize) {
+        if (of->file->fsize - offset < size) size = of->file->fsize - offset;
 
-    FILE* f = fopen(".dir", "r+b");
-    fwrite(&dir_struct, sizeof(dir_struct), 1, f);
-    fclose(f);
-    return 0;
+        if (of->file->nExtents < 0) { //a small file, one copy out of its record or packed block
+            bytes_read = read_small(of->file, buf, size, offset);
+        } else { //read in data, one extent at a time, and whatever is still buffered from the tail
+            off_t alloc_end = (off_t) map_blocks(&of->map) * block_size;
+            size_t on_disk = offset >= alloc_end ? 0 : (alloc_end - offset < size ? alloc_end - offset : size);
+            bytes_read = io_extents(&of->map, buf, on_disk, offset, 0);
+            if (bytes_read == on_disk && size > on_disk) {
+                memcpy(buf + on_disk, of->tail + (offset + on_disk - alloc_end), size - on_disk);
+                bytes_read = size;
+            }
+            readahead_file(of, offset, bytes_read);
+        }
+    }
+    pthread_rwlock_unlock(&of->lock);
+    unlock_file_dir(cur_dir);
+
+    if (opened_here) close_file(of);
+    log_trace("READ: Read %d bytes", bytes_read);
+    return bytes_read;
 }
 
-static int _read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info * fi) {
-    printf("--------------------------------------------------------------------->READ: %s\n", path);
-    
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
+//writes the data of src at offset, shared by _write and _write_buf
+static int write_file(const char *path, struct fuse_bufvec *src, off_t offset, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(src);
 
-    char dir_targ[9];
-    char file_targ[9];
-    char ext_targ[4];
+    if (strcmp(path, DEFRAG_PATH) == 0) { //whatever is written, it asks for a pass
+        request_defrag();
+        return size;
+    }
 
-    dir_targ[0] = 0;
-    file_targ[0] = 0;
-    ext_targ[0] = 0;
-    parse_path(path, dir_targ, file_targ, ext_targ);
+    //the handle from _open, only resolve the path when there is none
+    mkfs_open_file* of = fi != NULL ? (mkfs_open_file*) (uintptr_t) fi->fh : NULL;
+    int opened_here = of == NULL;
+    if (opened_here) {
+        of = open_path(path);
+        if (of == NULL) return -ENOENT;
+    }
 
-    touch(".disk");
+    //writers to different files of one directory only share its read lock
+    journal_begin();
+    mkfs_dir* cur_dir = lock_file_dir(of);
+    pthread_rwlock_wrlock(&of->lock);
+    mkfs_file_directory* cur_file = of->file;
 
-    //check to make sure path exists
-    mkfs_directory_entry cur_dir;
-    int dir_exists = find_dir(&cur_dir, dir_targ);
-    if (dir_exists == -1) return -ENOENT;
+    //blocks the file has are written in place, holes get blocks first, data past them is buffered in the tail
+    //until it is flushed. a write past the end leaves a hole behind
+    int res = size;
+    off_t alloc_end = 0;
+    size_t in_place = 0;
+    if (size <= 0) { //nothing to do
+        res = 0;
+    } else if (offset + size > MAX_FILE_SIZE) {
+        res = -EFBIG;
+    } else if (cur_file->nExtents < 0 && unpack_file(of, cur_dir) != 0) { //a small file is written in its tail
+        res = -ENOSPC;
+    } else if (offset > cur_file->fsize && fill_gap(of, cur_dir, offset) != 0) {
+        res = -ENOSPC;
+    } else {
+        alloc_end = (off_t) map_blocks(&of->map) * block_size;
+        in_place = offset >= alloc_end ? 0 : (alloc_end - offset < size ? alloc_end - offset : size);
+        log_trace("WRITE: File of %zu bytes, %zu bytes in place, %zu bytes buffered", cur_file->fsize, in_place, size - in_place);
+        if (fill_holes(cur_file, &of->map, offset, in_place, 0) == -1) {
+            res = -ENOSPC;
+        } else if (in_place < size && grow_tail(of, offset + size - alloc_end) == -1) {
+            res = -ENOSPC;
+        } else if (offset > alloc_end + (off_t) of->tail_len) { //the end of the gap, up to the write
+            memset(of->tail + of->tail_len, 0, offset - alloc_end - of->tail_len);
+        }
+    }
+    if (res > 0) {
+        //write the data, spliced straight into .disk when it comes from a pipe
+        char* tail_dst = in_place < size ? of->tail + (offset + in_place - alloc_end) : NULL;
+        if (src->count == 1 && !(src->buf[0].flags & FUSE_BUF_IS_FD)) {
+            io_extents(&of->map, src->buf[0].mem, in_place, offset, 1);
+            if (tail_dst != NULL) memcpy(tail_dst, (char*) src->buf[0].mem + in_place, size - in_place);
+        } else if (!image.spliceable) { //O_DIRECT and striping take no data spliced into .disk, copy it out of the pipe first
+            char* data = malloc(size);
+            struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+            mem.buf[0].mem = data;
+            ssize_t copied = fuse_buf_copy(&mem, src, 0);
+            if (copied == (ssize_t) size) {
+                io_extents(&of->map, data, in_place, offset, 1);
+                if (tail_dst != NULL) memcpy(tail_dst, data + in_place, size - in_place);
+            } else {
+                res = copied < 0 ? copied : -EIO;
+                size = 0;
+            }
+            free(data);
+        } else {
+            struct fuse_bufvec* dst = extent_bufvec(&of->map, in_place, offset);
+            if (tail_dst != NULL) {
+                dst = realloc(dst, sizeof(struct fuse_bufvec) + dst->count * sizeof(struct fuse_buf));
+                memset(&dst->buf[dst->count], 0, sizeof(struct fuse_buf));
+                dst->buf[dst->count].size = size - in_place;
+                dst->buf[dst->count].mem = tail_dst;
+                dst->count++;
+            }
+            ssize_t copied = fuse_buf_copy(dst, src, 0);
+            int i;
+            for (i = 0; i < dst->count; i++) {
+                if (dst->buf[i].flags & FUSE_BUF_IS_FD) cache_invalidate(dst->buf[i].pos, dst->buf[i].size);
+            }
+            free(dst);
+            if (copied < 0) {
+                res = copied;
+                size = 0;
+            } else if ((size_t) copied < size) { //the pipe ran short
+                res = size = copied;
+            }
+        }
 
-    int file_index = find_file(&cur_dir, file_targ, ext_targ);
-    if (file_index == -1) return -ENOENT;
+        if (size > 0 && offset + size > alloc_end && offset + size - alloc_end > of->tail_len) {
+            __atomic_add_fetch(&delalloc_bytes, offset + size - alloc_end - of->tail_len, __ATOMIC_RELAXED);
+            of->tail_len = offset + size - alloc_end;
+        }
+        if (size > 0 && offset + size > cur_file->fsize) {
+            cur_file->fsize = offset + size;
+        }
+        of->generation++;
+        if (cur_dir != NULL) {
+            mark_dirty(cur_dir, of->file_index); //written back with the next flush
+        }
 
-    mkfs_file_directory cur_file = cur_dir.files[file_index];
-    
-    if (size <= 0) return 0; //Why not?
-    
-    if (offset > cur_file.fsize) return 0; //nothing left
-    
-    //figure out where to read from
-    int read_index = cur_file.nStartBlock * 512 + offset;
-    int max_read = cur_file.fsize - offset;
-    if (max_read < size) size = max_read;
-    
-    //read in data
-    FILE* f = fopen(".disk", "rb");
-    fseek(f, read_index, SEEK_SET);
-    int bytes_read = fread(buf, 1, size, f);
-    printf("--------------------------------------------------------------------->READ: DBUG Read %d bytes\n", bytes_read);
-    fclose(f);
-    return bytes_read;
-}
+        //place the tail now when delayed allocation is off or too much is buffered
+        if (options.delalloc_kb == 0) {
+            flush_tail(of, cur_dir, 0);
+        } else if (of->tail_len >= (size_t) DELALLOC_FILE_KB * 1024
+                || __atomic_load_n(&delalloc_bytes, __ATOMIC_RELAXED) > (size_t) options.delalloc_kb * 1024) {
+            flush_tail(of, cur_dir, 1);
+        }
+    }
 
-static int _write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("--------------------------------------------------------------------->WRITE: %s\n", path);
-    
-    char dir_targ[9];
-    char file_targ[9];
-    char ext_targ[4];
+    pthread_rwlock_unlock(&of->lock);
+    unlock_file_dir(cur_dir);
+    journal_end();
 
-    dir_targ[0] = 0;
-    file_targ[0] = 0;
-    ext_targ[0] = 0;
-    parse_path(path, dir_targ, file_targ, ext_targ);
+    if (opened_here) close_file(of);
+    return res;
+}
 
-    touch(".disk");
+static int _write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    log_trace("WRITE: %s", path);
 
-    //check to make sure path exists
-    mkfs_directory_entry cur_dir;
-    int dir_index = find_dir(&cur_dir, dir_targ);
-    if (dir_index == -1) return -ENOENT;
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void*) buf;
+    uint64_t done = __atomic_load_n(&journal.done, __ATOMIC_ACQUIRE);
+    int res = write_file(path, &src, offset, fi);
+    while (res == -ENOSPC && commit_frees(done)) {
+        done = __atomic_load_n(&journal.done, __ATOMIC_ACQUIRE);
+        res = write_file(path, &src, offset, fi); //nothing was taken from src yet
+    }
+    return res;
+}
 
-    int file_index = find_file(&cur_dir, file_targ, ext_targ);
-    if (file_index == -1) return -ENOENT;
+//reads into a memory buffer through the plain read path, for read_buf when the data cannot be spliced
+static int read_to_mem(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec* bufv = malloc(sizeof(*bufv));
+    *bufv = FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].mem = malloc(size > 0 ? size : 1);
+    int res = _read(path, bufv->buf[0].mem, size, offset, fi);
+    if (res < 0) {
+        free(bufv->buf[0].mem);
+        free(bufv);
+        return res;
+    }
+    bufv->buf[0].size = res;
+    *bufp = bufv;
+    return 0;
+}
 
-    mkfs_file_directory cur_file = cur_dir.files[file_index];
+static int _read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    log_trace("READ_BUF: %s", path);
 
-    if (size <= 0) return 0; //Why not?
+    if (!splice_read || !image.spliceable || strcmp(path, STATS_PATH) == 0 || strcmp(path, DEFRAG_PATH) == 0) { //no splice, copy through the plain read path
+        return read_to_mem(path, bufp, size, offset, fi);
+    }
 
-    if (offset > cur_file.fsize) return 0; //nothing left
-    
-    printf("--------------------------------------------------------------------->WRITE: Size of cur_file = %d\n", cur_file.fsize);
-    //calculates number of bytes the file
-    int new_bytes = (offset + size) - cur_file.fsize;
-    int new_blocks = 0;
-    
-    printf("--------------------------------------------------------------------->WRITE: New bytes needed: %d\n", new_bytes);
-    
-    int blocks_used = 0;
-    while (blocks_used * BLOCK_SIZE < cur_file.fsize) {
-        blocks_used++;
+    //the handle from _open, only resolve the path when there is none
+    mkfs_open_file* of = fi != NULL ? (mkfs_open_file*) (uintptr_t) fi->fh : NULL;
+    int opened_here = of == NULL;
+    if (opened_here) {
+        of = open_path(path);
+        if (of == NULL) return -ENOENT;
     }
 
-    int bytes_left = (BLOCK_SIZE * blocks_used) - cur_file.fsize;
-    printf("--------------------------------------------------------------------->WRITE: Bytes availible in current block: %d\n", bytes_left);
-    
-    int i = new_bytes;
-    while (i > bytes_left) {
-        new_blocks++;
-        i -= BLOCK_SIZE;
+    mkfs_dir* cur_dir = lock_file_dir(of);
+    pthread_rwlock_rdlock(&of->lock);
+    if (offset >= of->file->fsize) {
+        size = 0;
+    } else if (of->file->fsize - offset < size) {
+        size = of->file->fsize - offset;
     }
-    
-    printf("--------------------------------------------------------------------->WRITE: New blocks needed: %d\n", new_blocks);
-    if (new_blocks > 0) {
-        int cur_blocks = cur_file.fsize / BLOCK_SIZE;
-        if (cur_file.fsize % BLOCK_SIZE != 0) {
-            cur_blocks++;
-        }
-        printf("--------------------------------------------------------------------->WRITE: Current blocks: %d\n", cur_blocks);
-        
-        //only unallocate space for files that have been allocated space!
-        printf("--------------------------------------------------------------------->WRITE: Start Block of current file: %d\n", cur_file.nStartBlock);
-        if (cur_file.nStartBlock != -1) {
-            unallocate(cur_file.nStartBlock, cur_blocks);
-        }
-
-        int new_start_loc = find_free_space(new_blocks + cur_blocks);
-        printf("--------------------------------------------------------------------->WRITE: Attempting to put file at %d\n", new_start_loc);
-        
-        if (new_start_loc == -1) { // then the space request is unsatisfiable via contiguous allocation
-            allocate(cur_file.nStartBlock, cur_blocks);
-            return -ENOSPC;
-        }
-        
-        allocate(new_start_loc, new_blocks + cur_blocks);
-        cur_dir.files[file_index].nStartBlock = new_start_loc;
+    int buffered = of->file->nExtents < 0 || (of->tail_len > 0 && offset + size > (off_t) map_blocks(&of->map) * block_size)
+            || map_sparse(&of->map, offset, size);
+    if (!buffered) {
+        *bufp = extent_bufvec(&of->map, size, offset);
     }
+    pthread_rwlock_unlock(&of->lock);
+    unlock_file_dir(cur_dir);
 
+    if (opened_here) close_file(of);
+    if (buffered) { //part of it only lives in the tail or is a hole, or it is a small file
+        return read_to_mem(path, bufp, size, offset, fi);
+    }
+    return 0;
+}
 
-    //write the data
-    int write_index = cur_dir.files[file_index].nStartBlock * BLOCK_SIZE + offset;
-    printf("--------------------------------------------------------------------->WRITE: Bitmap ends at %d.  Writing at %d.\n", get_bitmap_size(), write_index);
-    
-    FILE* f = fopen(".disk", "r+b");
-    fseek(f, write_index, SEEK_SET);
-    fwrite(buf, size, 1, f);
-    fclose(f);
+static int _write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    log_trace("WRITE_BUF: %s", path);
 
-    if (new_bytes > 0) {
-        cur_dir.files[file_index].fsize += new_bytes;
+    uint64_t done = __atomic_load_n(&journal.done, __ATOMIC_ACQUIRE);
+    int res = write_file(path, buf, offset, fi);
+    while (res == -ENOSPC && commit_frees(done)) {
+        done = __atomic_load_n(&journal.done, __ATOMIC_ACQUIRE);
+        res = write_file(path, buf, offset, fi); //nothing was taken from buf yet
     }
+    return res;
+}
+
+static int _open(const char *path, struct fuse_file_info * fi) {
+    log_trace("OPEN: %s", path);
 
-    FILE* g = fopen(".dir", "r+b");
-    fseek(g, dir_index, SEEK_SET);
-    fwrite(&cur_dir, sizeof(cur_dir), 1, g);
-    fclose(g);
+    if (strcmp(path, STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+        fi->fh = 0;
+        fi->direct_io = 1; //its size changes behind the page cache
+        return 0;
+    }
+    if (strcmp(path, DEFRAG_PATH) == 0) { //written to ask for a pass, read for what passes did
+        fi->fh = 0;
+        fi->direct_io = 1;
+        return 0;
+    }
 
-    // print_bitmap();
-    return size;
+    mkfs_open_file* of = open_path(path);
+    if (of == NULL) return -ENOENT;
+    fi->fh = (uintptr_t) of;
+    return 0;
 }
 
-static int _open(const char *path, struct fuse_file_info * fi) {
-    printf("--------------------------------------------------------------------->OPEN: %s\n", path);
+static int _release(const char *path, struct fuse_file_info *fi) {
+    log_trace("RELEASE: %s", path);
 
-    (void) path;
-    (void) fi;
- 
+    if (fi->fh != 0) close_file((mkfs_open_file*) (uintptr_t) fi->fh);
+    fi->fh = 0;
     return 0;
 }
 
+//places the buffered data of an open file, speculative adds preallocation for a file which stays open
+static int flush_open_file(struct fuse_file_info *fi, int speculative) {
+    mkfs_open_file* of = fi != NULL ? (mkfs_open_file*) (uintptr_t) fi->fh : NULL;
+    if (of == NULL) return 0;
+
+    journal_begin();
+    mkfs_dir* cur_dir = lock_file_dir(of);
+    pthread_rwlock_wrlock(&of->lock);
+    int res = flush_tail(of, cur_dir, speculative);
+    pthread_rwlock_unlock(&of->lock);
+    unlock_file_dir(cur_dir);
+    journal_end();
+    return res;
+}
+
 static int _flush (const char *path , struct fuse_file_info *fi) {
-	printf("--------------------------------------------------------------------->FLUSH: successfully\n");
+    log_trace("FLUSH: %s", path);
     (void) path;
-    (void) fi;
 
-    return 0;
+    int res = flush_open_file(fi, 0);
+    kick_flusher(); //committed in the background, fsync waits for it
+
+    return res;
+}
+
+static int _fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    log_trace("FSYNC: %s", path);
+    (void) isdatasync;
+
+    int res = flush_open_file(fi, 1);
+    flush_metadata();
+    if (res == 0 && sync_image() == -1) res = -errno;
+
+    return res;
+}
+
+//changes the size or the space of the file of fi, or of path when there is no handle: mode -1 sets its size to
+//offset, otherwise it is a fallocate mode
+static int change_space(const char *path, struct fuse_file_info *fi, int mode, off_t offset, off_t len) {
+    if (strcmp(path, DEFRAG_PATH) == 0) return mode == -1 ? 0 : -EOPNOTSUPP; //shells truncate it before a write
+    if (strcmp(path, STATS_PATH) == 0) return mode == -1 ? -EACCES : -EOPNOTSUPP;
+    if (offset < 0 || len < 0 || offset + len > MAX_FILE_SIZE) return offset < 0 || len < 0 ? -EINVAL : -EFBIG;
+
+    mkfs_open_file* of = fi != NULL ? (mkfs_open_file*) (uintptr_t) fi->fh : NULL;
+    int opened_here = of == NULL;
+    if (opened_here) {
+        of = open_path(path);
+        if (of == NULL) return -ENOENT;
+    }
+
+    journal_begin();
+    mkfs_dir* cur_dir = lock_file_dir(of);
+    pthread_rwlock_wrlock(&of->lock);
+    int res;
+    if (mode == -1) {
+        res = resize_file(of, cur_dir, offset);
+    } else if (mode & FALLOC_FL_PUNCH_HOLE) {
+        res = punch_file(of, cur_dir, offset, len);
+    } else {
+        res = allocate_file(of, cur_dir, offset, len, mode & FALLOC_FL_KEEP_SIZE);
+    }
+    pthread_rwlock_unlock(&of->lock);
+    unlock_file_dir(cur_dir);
+    journal_end();
+
+    if (opened_here) close_file(of);
+    return res;
 }
 
 static int _truncate(const char *path, off_t size) {
-    printf("--------------------------------------------------------------------->TRUNCATE: Truncated successfully\n");
-    
-    (void) path;
-    (void) size;
+    log_trace("TRUNCATE: %s", path);
 
-    return 0;
+    return change_space(path, NULL, -1, size, 0);
+}
+
+static int _ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    log_trace("FTRUNCATE: %s", path);
+
+    return change_space(path, fi, -1, size, 0);
+}
+
+static int _fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+    log_trace("FALLOCATE: %s mode %d", path, mode);
+
+    if (len <= 0) return -EINVAL;
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0) return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP; //as Linux wants it
+    return change_space(path, fi, mode, offset, len);
 }
\ No newline at end of file
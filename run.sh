@@ -1,4 +1,4 @@
 rm ./mkfs
 mkdir ./mkfs_root
-gcc mkfs.c -o mkfs -lfuse
+gcc mkfs.c -o mkfs -lfuse -lpthread
 ./mkfs -d mkfs_root/
\ No newline at end of file